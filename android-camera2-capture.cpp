@@ -35,9 +35,45 @@
 #include <camera/NdkCameraMetadataTags.h>
 #include <media/NdkImageReader.h>
 
+#include "android-camera2-capture.h"
+#include "android-camera2-convert.h"
+#include "android-camera2-dump.h"
+#include "android-camera2-trace.h"
+
 #include <jni.h>
 #include <math.h>
 
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <list>
+#include <map>
+#include <string>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#define ANDROID_CAMERA2_HIGH_FRAME_RATE_MAX_RANGES 8
+#define ANDROID_CAMERA2_HIGH_FRAME_RATE_CHECK_INTERVAL 1000 // ms
+// Checks in a row under 90% of the programmed rate before falling back
+#define ANDROID_CAMERA2_HIGH_FRAME_RATE_MAX_MISSED_CHECKS 2
+
+// Delay before starting again after a failed session creation, doubled at each failure
+#define ANDROID_CAMERA2_START_RETRY_MIN_DELAY 250 // ms
+#define ANDROID_CAMERA2_START_RETRY_MAX_DELAY 8000 // ms
+
+// Can't use AIMAGE_FORMAT_PRIVATE, only present starting API 26, it is the format the HAL uses for SurfaceTexture outputs
+#define ANDROID_CAMERA2_PREVIEW_STREAM_FORMAT 0x22
+
 struct AndroidCamera2Device {
 	AndroidCamera2Device(char *id) : camId(id), orientation(0), back_facing(false) {
 		
@@ -54,9 +90,111 @@ struct AndroidCamera2Device {
 	bool back_facing;
 };
 
+struct AndroidCamera2CaptureResult {
+	int64_t frameNumber;
+	int64_t timestamp; // ns, ACAMERA_SENSOR_TIMESTAMP, same clock as AImage_getTimestamp
+	int64_t frameDuration; // ns, 0 until the capture is completed
+	int64_t exposureTime; // ns, 0 until the capture is completed
+	int32_t cropRegion[4]; // ACAMERA_SCALER_CROP_REGION applied to the capture, left, top, width, height, 0 if unknown
+	int faceCount; // -1 until the capture is completed, or if face detection isn't running
+	int32_t faceRectangles[MS_ANDROID_CAMERA2_CAPTURE_MAX_FACES][4]; // left, top, right, bottom in active array coordinates
+	uint8_t faceScores[MS_ANDROID_CAMERA2_CAPTURE_MAX_FACES];
+};
+
+/*
+ * Lock-free ring of the latest capture results, written by the capture session callbacks (all delivered on the same camera thread)
+ * and read by the image reader callback. Each slot carries a sequence number, odd while being written, so that a reader
+ * can detect a slot overwritten while it copies it.
+ */
+struct AndroidCamera2CaptureResultRing {
+	static const uint32_t size = 16;
+
+	AndroidCamera2CaptureResultRing() {
+		reset();
+	}
+
+	// Must not be called while the producer is running
+	void reset() {
+		for (uint32_t i = 0; i < size; i++) {
+			slots[i].sequence.store(0, std::memory_order_relaxed);
+			slots[i].result = AndroidCamera2CaptureResult();
+		}
+		writeIndex.store(0, std::memory_order_release);
+	}
+
+	// Producer side only
+	void push(const AndroidCamera2CaptureResult &result) {
+		uint32_t index = writeIndex.load(std::memory_order_relaxed);
+		write(slots[index % size], result);
+		writeIndex.store(index + 1, std::memory_order_release);
+	}
+
+	// Producer side only, completes the entry of a capture previously pushed when it started
+	bool update(const AndroidCamera2CaptureResult &result) {
+		uint32_t index = writeIndex.load(std::memory_order_relaxed);
+		for (uint32_t i = 1; i <= size && i <= index; i++) {
+			Slot &slot = slots[(index - i) % size];
+			if (slot.result.timestamp == result.timestamp) {
+				AndroidCamera2CaptureResult updated = result;
+				updated.frameNumber = slot.result.frameNumber;
+				write(slot, updated);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Consumer side
+	bool find(int64_t timestamp, AndroidCamera2CaptureResult *result) {
+		uint32_t index = writeIndex.load(std::memory_order_acquire);
+		for (uint32_t i = 1; i <= size && i <= index; i++) {
+			Slot &slot = slots[(index - i) % size];
+			uint32_t before = slot.sequence.load(std::memory_order_acquire);
+			if (before & 1) continue;
+			AndroidCamera2CaptureResult copy = slot.result;
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (slot.sequence.load(std::memory_order_relaxed) != before) continue;
+			if (copy.timestamp == timestamp) {
+				*result = copy;
+				return true;
+			}
+		}
+		return false;
+	}
+
+private:
+	struct Slot {
+		std::atomic<uint32_t> sequence;
+		AndroidCamera2CaptureResult result;
+	};
+
+	void write(Slot &slot, const AndroidCamera2CaptureResult &result) {
+		uint32_t sequence = slot.sequence.load(std::memory_order_relaxed);
+		slot.sequence.store(sequence + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		slot.result = result;
+		slot.sequence.store(sequence + 2, std::memory_order_release);
+	}
+
+	Slot slots[size];
+	std::atomic<uint32_t> writeIndex;
+};
+
+static ACameraManager *android_camera2_manager_acquire(void);
+static void android_camera2_manager_release(void);
+
+struct AndroidCamera2PacedFrame {
+	mblk_t *frame;
+	bool hasFaces;
+	MSAndroidCamera2CaptureFaces faces;
+	uint64_t sensorTime; // ms, from the image timestamp
+	uint64_t queuedTime; // ms, ticker time
+};
+
 struct AndroidCamera2Context {
 	AndroidCamera2Context(MSFilter *f) : filter(f), configured(false), capturing(false), device(nullptr), rotation(0), nativeWindowId(nullptr), surface(nullptr),
-			captureFormat(AIMAGE_FORMAT_YUV_420_888),
+			captureFormat(AIMAGE_FORMAT_YUV_420_888), outputFormat(MS_YUV420P), lumaDecimation(1), profile(MSAndroidCamera2CaptureProfileDefault),
+			availableNoiseReductionModes(0), availableEdgeModes(0), availableVideoStabilizationModes(0), pipelineMaxDepth(0), maxDigitalZoom(1),
 			frame(nullptr), bufAllocator(ms_yuv_buf_allocator_new()), fps(5), 
 			cameraDevice(nullptr), captureSession(nullptr), captureSessionOutputContainer(nullptr), 
 			nativeWindow(nullptr), captureWindow(nullptr), capturePreviewRequest(nullptr), 
@@ -67,17 +205,121 @@ struct AndroidCamera2Context {
 		captureSize.height = 0;
 		previewSize.width = 0;
 		previewSize.height = 0;
+		requestedPreviewStreamSize.width = 0;
+		requestedPreviewStreamSize.height = 0;
+		previewStreamSize.width = 0;
+		previewStreamSize.height = 0;
+		requestedCaptureSize.width = 0;
+		requestedCaptureSize.height = 0;
+		memset(activeArraySize, 0, sizeof(activeArraySize));
+		zoom.factor = 1;
+		zoom.centerX = 0.5f;
+		zoom.centerY = 0.5f;
+		faceDetectionSupported = false;
+		faceDetection = true;
+		frameHasFaces = false;
+		memset(&frameFaces, 0, sizeof(frameFaces));
+		memset(&lastFaces, 0, sizeof(lastFaces));
 		ms_mutex_init(&mutex, NULL);
-
-    	cameraManager = ACameraManager_create();
+		memset(&captureCallbacks, 0, sizeof(captureCallbacks));
+		memset(&workerConfig, 0, sizeof(workerConfig));
+		workerRunning = false;
+		workerPendingImages = 0;
+		ms_cond_init(&workerCond, NULL);
+		pacing.enabled = FALSE;
+		pacing.depth = 2;
+		pacing.latency = 0;
+		pacedFrameCount = 0;
+		pacingOffset = 0;
+		pacingNextEmitTime = 0;
+		frameSensorTime = 0;
+		sensorClockOffset = 0;
+		sensorClockOffsetSet = false;
+		sensorTimestampRealtime = false;
+		pushMode = false;
+		pushTicker = nullptr;
+		pushWaiting = false;
+		pushEntered = false;
+		previousTickFunc = nullptr;
+		previousTickFuncData = nullptr;
+		ms_cond_init(&pushCond, NULL);
+		sceneDetection.enabled = FALSE;
+		sceneDetection.dropStaticFrames = FALSE;
+		sceneDetection.staticThreshold = 1.5f;
+		sceneDetection.sceneChangeThreshold = 40.f;
+		sceneDetection.keepAliveInterval = 1000;
+		sceneGrid = nullptr;
+		sceneGridSize = 0;
+		sceneDifference = 0;
+		lastNonStaticFrameTime = 0;
+		prewarmed = false;
+		startRequestTime = 0;
+		previewCreationDuration = 0;
+		cameraOpenDuration = 0;
+		sessionCreationDuration = 0;
+		firstHalFrameTime = 0;
+		firstFrameTime = 0;
+		captureStarts = 0;
+
+		concurrentSizeLimit.width = 1280;
+		concurrentSizeLimit.height = 720;
+		concurrentCapture = false;
+		concurrentSizeLimited = false;
+		startRetryTime = 0;
+		startRetryDelay = 0;
+
+		memset(&highFrameRate, 0, sizeof(highFrameRate));
+		highFrameRateRangeCount = 0;
+		highFrameRateRangeIndex = -1;
+		highFrameRateCheckTime = 0;
+		highFrameRateCheckFrames = 0;
+		highFrameRateSettling = true;
+		highFrameRateConfirmed = false;
+		highFrameRateMissedChecks = 0;
+		highFrameRateExhausted = false;
+		templateFpsRange[0] = templateFpsRange[1] = 0;
+		hasTemplateFpsRange = false;
+
+		suspend.suspended = FALSE;
+		suspend.output = MSAndroidCamera2CaptureSuspendOutputNone;
+		suspend.fps = 1;
+		suspended = false;
+		resumeRequestTime = 0;
+		lastSuspendedFrameTime = 0;
+		lastFrame = nullptr;
+		blackFrame = nullptr;
+		blackFrameSize.width = 0;
+		blackFrameSize.height = 0;
+
+		ms_mutex_init(&dumpMutex, NULL);
+		dumpWriter = nullptr;
+		replayReader = nullptr;
+		memset(&replay, 0, sizeof(replay));
+		cameraCaptureSize.width = 0;
+		cameraCaptureSize.height = 0;
+		replayRunning = false;
+		replayPaused = false;
+		replayIdle = true;
+		android_camera2_converter_init(&converter, bufAllocator);
+		convertKernelDirty = true;
+
+		cameraManager = android_camera2_manager_acquire();
 	};
 
 	~AndroidCamera2Context() {
 		// Don't delete device object in here !
+		ms_cond_destroy(&workerCond);
+		ms_cond_destroy(&pushCond);
 		ms_mutex_destroy(&mutex);
+		if (sceneGrid) ms_free(sceneGrid);
+		if (lastFrame) freemsg(lastFrame);
+		if (blackFrame) freemsg(blackFrame);
+		if (dumpWriter) android_camera2_dump_writer_close(dumpWriter);
+		if (replayReader) android_camera2_dump_reader_close(replayReader);
+		ms_mutex_destroy(&dumpMutex);
 		if (bufAllocator) ms_yuv_buf_allocator_free(bufAllocator);
 
-		ACameraManager_delete(cameraManager);
+		android_camera2_manager_release();
 	};
 
 	MSFilter *filter;
@@ -90,10 +332,33 @@ struct AndroidCamera2Context {
 
 	MSVideoSize captureSize;
 	MSVideoSize previewSize;
+	MSVideoSize requestedCaptureSize; // last size set, captureSize may be lower for high frame rate or concurrent capture
+	MSVideoSize requestedPreviewStreamSize; // 0x0 means same as captureSize
+	MSVideoSize previewStreamSize;
 	int32_t captureFormat;
+	MSPixFmt outputFormat;
+	int lumaDecimation; // 1, 2 or 4, only used for MS_ANDROID_CAMERA2_PIX_FMT_GRAY8 output
+
+	MSAndroidCamera2CaptureProfile profile;
+	// Bitmasks of the modes supported by the device, indexed by mode value
+	uint32_t availableNoiseReductionModes;
+	uint32_t availableEdgeModes;
+	uint32_t availableVideoStabilizationModes;
+	int pipelineMaxDepth;
+	int32_t activeArraySize[4]; // left, top, width, height
+	float maxDigitalZoom;
+	MSAndroidCamera2CaptureZoom zoom;
+	bool faceDetectionSupported; // simple mode, the only one without landmarks and ids
+	bool faceDetection;
 
 	ms_mutex_t mutex;
 	mblk_t *frame;
+	uint64_t frameSensorTime; // us, from the image timestamp
+	int64_t sensorClockOffset; // us, from sensor time to get_time_us() time
+	bool sensorClockOffsetSet;
+	bool sensorTimestampRealtime; // sensor timestamps are CLOCK_BOOTTIME ones
+	bool frameHasFaces;
+	MSAndroidCamera2CaptureFaces frameFaces;
 	MSYuvBufAllocator *bufAllocator;
 
 	float fps;
@@ -118,12 +383,319 @@ struct AndroidCamera2Context {
 
 	ACameraDevice_StateCallbacks deviceStateCallbacks;
 	ACameraCaptureSession_stateCallbacks captureSessionStateCallbacks;
+	ACameraCaptureSession_captureCallbacks captureCallbacks;
+
+	// Written by the capture session callbacks
+	AndroidCamera2CaptureResultRing captureResults;
+	int64_t startedFrames;
+	int64_t lastSensorTimestamp;
+	std::atomic<int64_t> capturedFrames;
+	std::atomic<int64_t> halDroppedFrames;
+	std::atomic<int64_t> sensorSkippedFrames;
+	std::atomic<int64_t> requestedFrameDuration;
+	std::atomic<int64_t> averageFrameInterval;
+	std::atomic<int64_t> sensorFrameDuration;
+	std::atomic<int64_t> exposureTime;
+
+	// Written by the image reader callback
+	int64_t lastDeliveredFrameNumber;
+	std::atomic<int64_t> undeliveredFrames;
+	std::atomic<int64_t> pluginDroppedFrames;
+	std::atomic<int64_t> convertedFrames;
+	std::atomic<int64_t> callbackCpuTime;
+	std::atomic<int64_t> conversionCpuTime;
+
+	MSAndroidCamera2CaptureWorkerConfig workerConfig;
+	ms_thread_t workerThread;
+	ms_cond_t workerCond;
+	bool workerRunning;
+	int workerPendingImages;
+
+	// Protected by mutex
+	MSAndroidCamera2CapturePacing pacing;
+	AndroidCamera2PacedFrame pacedFrames[ANDROID_CAMERA2_PACING_MAX_DEPTH];
+	int pacedFrameCount;
+	int64_t pacingOffset; // ms, from sensor time to ticker time
+	uint64_t pacingNextEmitTime; // ms, ticker time, 0 until offset is computed
+	std::atomic<int64_t> pacingLatency; // us
+	std::atomic<int64_t> emitLatency; // us
+	std::atomic<int64_t> maxEmitLatency; // us
+
+	// Push mode replaces the wait between ticks of the filter's ticker, woken by pushCond when a frame is queued
+	bool pushMode;
+	MSTicker *pushTicker; // ticker the wait function is installed on, protected by mutex
+	bool pushWaiting; // ticker thread is in the wait function, protected by mutex
+	bool pushEntered; // ticker thread called the wait function since process() last ran, protected by mutex
+	MSTickerTickFunc previousTickFunc;
+	void *previousTickFuncData;
+	ms_cond_t pushCond;
+
+	// Used from the thread converting images
+	MSAndroidCamera2CaptureSceneDetection sceneDetection;
+	uint8_t *sceneGrid; // luma samples of the previous frame
+	int sceneGridSize;
+	float sceneDifference;
+	uint64_t lastNonStaticFrameTime;
+	MSAndroidCamera2CaptureFaces lastFaces; // faces of the latest completed capture, for frames converted before their result
+	std::atomic<int64_t> staticFrames;
+	std::atomic<int64_t> sceneChanges;
+
+	// Time to first frame breakdown, ms
+	bool prewarmed;
+	std::atomic<uint64_t> startRequestTime;
+	uint64_t previewCreationDuration;
+	uint64_t cameraOpenDuration;
+	uint64_t sessionCreationDuration;
+	std::atomic<uint64_t> firstHalFrameTime;
+	std::atomic<uint64_t> firstFrameTime;
+	std::atomic<int64_t> captureStarts;
+
+	// Max capture size while another camera is capturing, lowered each time a concurrent session fails
+	MSVideoSize concurrentSizeLimit;
+	bool concurrentCapture;
+	bool concurrentSizeLimited; // captureSize was lowered below requestedCaptureSize by the limit
+	uint64_t startRetryTime; // ms, no start attempt before this time
+	int startRetryDelay; // ms, 0 until a start fails
+
+	// Protected by the filter lock, candidate AE target fps ranges are sorted by decreasing max fps
+	MSAndroidCamera2CaptureHighFrameRate highFrameRate;
+	int32_t highFrameRateRanges[ANDROID_CAMERA2_HIGH_FRAME_RATE_MAX_RANGES][2];
+	int highFrameRateRangeCount;
+	int highFrameRateRangeIndex; // programmed range, -1 if none
+	uint64_t highFrameRateCheckTime; // ms, ticker time of the start of the check window, 0 to start a new one
+	int64_t highFrameRateCheckFrames; // capturedFrames at the start of the check window
+	bool highFrameRateSettling; // first window after the rate is programmed, AE may still be converging
+	bool highFrameRateConfirmed;
+	int highFrameRateMissedChecks;
+	bool highFrameRateExhausted; // lowest range isn't delivered either, no more checks until a range is programmed again
+	int32_t templateFpsRange[2]; // AE target fps range of the request template, restored when high frame rate is off
+	bool hasTemplateFpsRange;
+
+	// Protected by the filter lock
+	MSAndroidCamera2CaptureSuspend suspend;
+	bool suspended;
+	std::atomic<uint64_t> resumeRequestTime; // ms, until the first frame after resuming
+	uint64_t lastSuspendedFrameTime; // ms, ticker time
+	mblk_t *lastFrame; // reference on the last frame sent
+	mblk_t *blackFrame;
+	MSVideoSize blackFrameSize;
+
+	ms_mutex_t dumpMutex;
+	AndroidCamera2DumpWriter *dumpWriter; // protected by dumpMutex
+
+	// Replay replaces the camera while set, captureSize is the one of the dump then
+	AndroidCamera2DumpReader *replayReader;
+	MSAndroidCamera2CaptureReplay replay;
+	MSVideoSize cameraCaptureSize; // restored when the replay is stopped
+	ms_thread_t replayThread;
+	std::atomic<bool> replayRunning;
+	std::atomic<bool> replayPaused; // while suspended, the thread keeps its position in the dump
+	std::atomic<bool> replayIdle; // set by the thread while paused and once finished, it queues no frame then
+
+	// Only used by the converting thread, the kernel is selected again when the orientation or output format changes
+	AndroidCamera2Converter converter;
+	std::atomic<bool> convertKernelDirty;
+};
+
+/* ************************************************************************* */
+
+/*
+ * Camera manager and camera characteristics are shared by all the filter instances and by camera detection.
+ * The service also keeps track of the filters currently capturing, to apply concurrent capture limits.
+ * Characteristics don't change while the process runs, so the ones returned by android_camera2_manager_get_characteristics()
+ * are cached and kept when the last reference is released: detection can then fill the cache for the filters created later.
+ * A reference must still be held to call it, to get the characteristics not cached yet.
+ */
+struct AndroidCamera2Manager {
+	AndroidCamera2Manager() : refCount(0), cameraManager(nullptr) {
+		ms_mutex_init(&mutex, NULL);
+	};
+
+	ms_mutex_t mutex;
+	int refCount;
+	ACameraManager *cameraManager;
+	std::map<std::string, ACameraMetadata *> characteristics;
+	std::list<AndroidCamera2Context *> activeCaptures;
 };
 
+static AndroidCamera2Manager android_camera2_manager;
+
+static ACameraManager *android_camera2_manager_acquire(void) {
+	ms_mutex_lock(&android_camera2_manager.mutex);
+	if (android_camera2_manager.refCount++ == 0) {
+		android_camera2_manager.cameraManager = ACameraManager_create();
+		ms_message("[Camera2 Capture] Shared camera manager created");
+	}
+	ACameraManager *cameraManager = android_camera2_manager.cameraManager;
+	ms_mutex_unlock(&android_camera2_manager.mutex);
+	return cameraManager;
+}
+
+static void android_camera2_manager_release(void) {
+	ms_mutex_lock(&android_camera2_manager.mutex);
+	if (--android_camera2_manager.refCount == 0) {
+		ACameraManager_delete(android_camera2_manager.cameraManager);
+		android_camera2_manager.cameraManager = nullptr;
+		ms_message("[Camera2 Capture] Shared camera manager destroyed");
+	}
+	ms_mutex_unlock(&android_camera2_manager.mutex);
+}
+
+static const char* android_camera2_status_to_string(camera_status_t status);
+
+static const ACameraMetadata *android_camera2_manager_get_characteristics(const char *camId) {
+	ACameraMetadata *cameraMetadata = nullptr;
+
+	ms_mutex_lock(&android_camera2_manager.mutex);
+	auto it = android_camera2_manager.characteristics.find(camId);
+	if (it != android_camera2_manager.characteristics.end()) {
+		cameraMetadata = it->second;
+	} else {
+		camera_status_t camera_status = ACameraManager_getCameraCharacteristics(android_camera2_manager.cameraManager, camId, &cameraMetadata);
+		if (camera_status != ACAMERA_OK) {
+			ms_error("[Camera2 Capture] Failed to get camera %s characteristics, error is %s", camId, android_camera2_status_to_string(camera_status));
+			cameraMetadata = nullptr;
+		} else {
+			android_camera2_manager.characteristics[camId] = cameraMetadata;
+		}
+	}
+	ms_mutex_unlock(&android_camera2_manager.mutex);
+
+	return cameraMetadata;
+}
+
+/* Returns the number of other cameras capturing, or -1 if this camera is already used by another filter */
+static int android_camera2_manager_add_active_capture(AndroidCamera2Context *d, const char *camId) {
+	int others = 0;
+
+	ms_mutex_lock(&android_camera2_manager.mutex);
+	for (AndroidCamera2Context *active : android_camera2_manager.activeCaptures) {
+		if (active == d) continue;
+		if (strcmp(active->device->camId, camId) == 0) {
+			ms_mutex_unlock(&android_camera2_manager.mutex);
+			return -1;
+		}
+		others++;
+	}
+	android_camera2_manager.activeCaptures.remove(d);
+	android_camera2_manager.activeCaptures.push_back(d);
+	ms_mutex_unlock(&android_camera2_manager.mutex);
+
+	return others;
+}
+
+/* Returns the number of filters capturing, this one excepted */
+static int android_camera2_manager_count_other_captures(AndroidCamera2Context *d) {
+	int others = 0;
+
+	ms_mutex_lock(&android_camera2_manager.mutex);
+	for (AndroidCamera2Context *active : android_camera2_manager.activeCaptures) {
+		if (active != d) others++;
+	}
+	ms_mutex_unlock(&android_camera2_manager.mutex);
+
+	return others;
+}
+
+static void android_camera2_manager_remove_active_capture(AndroidCamera2Context *d) {
+	ms_mutex_lock(&android_camera2_manager.mutex);
+	android_camera2_manager.activeCaptures.remove(d);
+	ms_mutex_unlock(&android_camera2_manager.mutex);
+}
+
 /* ************************************************************************* */
 
 static void android_camera2_capture_stop(AndroidCamera2Context *d);
 
+static uint64_t android_camera2_capture_get_time_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static uint64_t android_camera2_capture_get_time_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+// Offset to add to a CLOCK_BOOTTIME time to get a get_time_us() one, they differ by the time spent in deep sleep
+static int64_t android_camera2_capture_get_boot_time_offset(void) {
+	struct timespec boot;
+	clock_gettime(CLOCK_BOOTTIME, &boot);
+	int64_t bootTime = (int64_t)boot.tv_sec * 1000000LL + boot.tv_nsec / 1000;
+	return (int64_t)android_camera2_capture_get_time_us() - bootTime;
+}
+
+static float android_camera2_capture_get_time_to_first_frame(AndroidCamera2Context *d) {
+	uint64_t firstFrameTime = d->firstFrameTime;
+	uint64_t startRequestTime = d->startRequestTime;
+	if (firstFrameTime == 0 || startRequestTime == 0 || firstFrameTime < startRequestTime) return 0;
+	return (float)(firstFrameTime - startRequestTime);
+}
+
+static int64_t android_camera2_capture_get_thread_cpu_time(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Only call while no capture session is running
+static void android_camera2_capture_reset_stats(AndroidCamera2Context *d) {
+	d->captureResults.reset();
+	d->startedFrames = 0;
+	d->lastSensorTimestamp = 0;
+	d->capturedFrames = 0;
+	d->halDroppedFrames = 0;
+	d->sensorSkippedFrames = 0;
+	d->requestedFrameDuration = 0;
+	d->averageFrameInterval = 0;
+	d->sensorFrameDuration = 0;
+	d->exposureTime = 0;
+	d->lastDeliveredFrameNumber = -1;
+	d->undeliveredFrames = 0;
+	d->pluginDroppedFrames = 0;
+	d->convertedFrames = 0;
+	d->callbackCpuTime = 0;
+	d->conversionCpuTime = 0;
+	d->pacingLatency = 0;
+	d->emitLatency = 0;
+	d->maxEmitLatency = 0;
+	d->sensorClockOffsetSet = false;
+	d->staticFrames = 0;
+	d->sceneChanges = 0;
+}
+
+static void android_camera2_capture_get_stats_internal(AndroidCamera2Context *d, MSAndroidCamera2CaptureStats *stats) {
+	stats->capturedFrames = d->capturedFrames;
+	stats->halDroppedFrames = d->halDroppedFrames;
+	stats->sensorSkippedFrames = d->sensorSkippedFrames;
+	// Frames missing between two delivered images that the HAL didn't report were lost in the image reader
+	int64_t readerDropped = d->undeliveredFrames - d->halDroppedFrames;
+	stats->readerDroppedFrames = readerDropped > 0 ? readerDropped : 0;
+	stats->pluginDroppedFrames = d->pluginDroppedFrames;
+	stats->requestedFrameDuration = d->requestedFrameDuration / 1000000.f;
+	stats->actualFrameDuration = d->averageFrameInterval / 1000000.f;
+	stats->sensorFrameDuration = d->sensorFrameDuration / 1000000.f;
+	stats->exposureTime = d->exposureTime / 1000000.f;
+	stats->convertedFrames = d->convertedFrames;
+	stats->callbackCpuTime = d->callbackCpuTime / 1000000.f;
+	stats->conversionCpuTime = d->conversionCpuTime / 1000000.f;
+	stats->pacingLatency = d->pacingLatency / 1000.f;
+	stats->emitLatency = d->emitLatency / 1000.f;
+	stats->maxEmitLatency = d->maxEmitLatency / 1000.f;
+	stats->staticFrames = d->staticFrames;
+	stats->sceneChanges = d->sceneChanges;
+	stats->sceneDifference = d->sceneDifference;
+	stats->timeToFirstFrame = android_camera2_capture_get_time_to_first_frame(d);
+	stats->captureStarts = d->captureStarts;
+}
+
+// Rate frames are captured and paced at, the high frame rate one while it is active
+static float android_camera2_capture_get_target_fps(AndroidCamera2Context *d) {
+	return d->highFrameRate.activeFps > 0 ? (float)d->highFrameRate.activeFps : d->fps;
+}
+
 static void android_camera2_capture_device_on_disconnected(void *context, ACameraDevice *device) {
     ms_message("[Camera2 Capture] Camera %s is diconnected", ACameraDevice_getId(device));
 
@@ -150,6 +722,102 @@ static void android_camera2_capture_session_on_closed(void *context, ACameraCapt
     ms_message("[Camera2 Capture] Session is closed %p", session);
 }
 
+/*
+ * NDK doesn't give frame numbers with the results before API 34, so frames are numbered in the order the HAL starts them,
+ * which includes the ones that will fail later on. Capture callbacks of a session are all called from the same thread.
+ */
+static void android_camera2_capture_on_capture_started(void *context, ACameraCaptureSession *session, const ACaptureRequest *request, int64_t timestamp) {
+	AndroidCamera2Context *d = (AndroidCamera2Context *)context;
+
+	if (d->lastSensorTimestamp != 0) {
+		int64_t interval = timestamp - d->lastSensorTimestamp;
+		int64_t average = d->averageFrameInterval;
+		if (average == 0) {
+			average = interval;
+		} else {
+			int64_t expected = d->sensorFrameDuration != 0 ? (int64_t)d->sensorFrameDuration : average;
+			if (expected > 0 && interval > expected + expected / 2) {
+				d->sensorSkippedFrames += (interval + expected / 2) / expected - 1;
+			}
+			average += (interval - average) / 8;
+		}
+		d->averageFrameInterval = average;
+	}
+	d->lastSensorTimestamp = timestamp;
+
+	AndroidCamera2CaptureResult result;
+	if (d->startedFrames == 0) {
+		d->firstHalFrameTime = android_camera2_capture_get_time_ms();
+	}
+	result.frameNumber = d->startedFrames++;
+	result.timestamp = timestamp;
+	result.frameDuration = 0;
+	result.exposureTime = 0;
+	memset(result.cropRegion, 0, sizeof(result.cropRegion));
+	result.faceCount = -1;
+	d->captureResults.push(result);
+}
+
+static void android_camera2_capture_on_capture_completed(void *context, ACameraCaptureSession *session, ACaptureRequest *request, const ACameraMetadata *metadata) {
+	AndroidCamera2Context *d = (AndroidCamera2Context *)context;
+	ACameraMetadata_const_entry entry;
+
+	AndroidCamera2CaptureResult result;
+	result.frameNumber = -1;
+	result.timestamp = 0;
+	result.frameDuration = 0;
+	result.exposureTime = 0;
+	memset(result.cropRegion, 0, sizeof(result.cropRegion));
+	result.faceCount = -1;
+	if (ACameraMetadata_getConstEntry(metadata, ACAMERA_SENSOR_TIMESTAMP, &entry) == ACAMERA_OK) {
+		result.timestamp = entry.data.i64[0];
+	}
+	if (ACameraMetadata_getConstEntry(metadata, ACAMERA_SENSOR_FRAME_DURATION, &entry) == ACAMERA_OK) {
+		result.frameDuration = entry.data.i64[0];
+		d->sensorFrameDuration = result.frameDuration;
+	}
+	if (ACameraMetadata_getConstEntry(metadata, ACAMERA_SENSOR_EXPOSURE_TIME, &entry) == ACAMERA_OK) {
+		result.exposureTime = entry.data.i64[0];
+		d->exposureTime = result.exposureTime;
+	}
+	if (ACameraMetadata_getConstEntry(metadata, ACAMERA_CONTROL_AE_TARGET_FPS_RANGE, &entry) == ACAMERA_OK && entry.data.i32[1] > 0) {
+		d->requestedFrameDuration = 1000000000LL / entry.data.i32[1];
+	}
+	if (ACameraMetadata_getConstEntry(metadata, ACAMERA_SCALER_CROP_REGION, &entry) == ACAMERA_OK && entry.count == 4) {
+		memcpy(result.cropRegion, entry.data.i32, sizeof(result.cropRegion));
+	}
+	if (ACameraMetadata_getConstEntry(metadata, ACAMERA_STATISTICS_FACE_DETECT_MODE, &entry) == ACAMERA_OK
+		&& entry.data.u8[0] != ACAMERA_STATISTICS_FACE_DETECT_MODE_OFF) {
+		result.faceCount = 0;
+		if (ACameraMetadata_getConstEntry(metadata, ACAMERA_STATISTICS_FACE_RECTANGLES, &entry) == ACAMERA_OK) {
+			result.faceCount = entry.count / 4 < MS_ANDROID_CAMERA2_CAPTURE_MAX_FACES ? entry.count / 4 : MS_ANDROID_CAMERA2_CAPTURE_MAX_FACES;
+			memcpy(result.faceRectangles, entry.data.i32, result.faceCount * 4 * sizeof(int32_t));
+		}
+		ACameraMetadata_const_entry scores;
+		bool hasScores = ACameraMetadata_getConstEntry(metadata, ACAMERA_STATISTICS_FACE_SCORES, &scores) == ACAMERA_OK;
+		for (int i = 0; i < result.faceCount; i++) {
+			result.faceScores[i] = hasScores && (uint32_t)i < scores.count ? scores.data.u8[i] : 100;
+		}
+	}
+
+	d->captureResults.update(result);
+	d->capturedFrames++;
+}
+
+static void android_camera2_capture_on_capture_failed(void *context, ACameraCaptureSession *session, ACaptureRequest *request, ACameraCaptureFailure *failure) {
+	AndroidCamera2Context *d = (AndroidCamera2Context *)context;
+	d->halDroppedFrames++;
+	ms_debug("[Camera2 Capture] Capture of frame %lld failed, reason is %d, image was %scaptured", (long long)failure->frameNumber, failure->reason, failure->wasImageCaptured ? "" : "not ");
+}
+
+static void android_camera2_capture_on_capture_buffer_lost(void *context, ACameraCaptureSession *session, ACaptureRequest *request, ANativeWindow *window, int64_t frameNumber) {
+	AndroidCamera2Context *d = (AndroidCamera2Context *)context;
+	if (window == d->captureWindow) {
+		d->halDroppedFrames++;
+		ms_debug("[Camera2 Capture] Buffer of frame %lld lost", (long long)frameNumber);
+	}
+}
+
 /* ************************************************************************* */
 
 // https://developer.android.com/ndk/reference/group/camera.html
@@ -209,45 +877,478 @@ static int32_t android_camera2_capture_get_orientation(AndroidCamera2Context *d)
 	return orientation;
 }
 
-static mblk_t* android_camera2_capture_image_to_mblkt(AndroidCamera2Context *d, AImage *image) {
-	int32_t width, height;
-	int32_t yStride, uvStride;
-	uint8_t *yPixel, *uPixel, *vPixel;
-	int32_t yLen, uLen, vLen;
-	int32_t yPixelStride, uvPixelStride;
+/*
+ * Face rectangles are in active array coordinates. The frame is the crop region, further cropped by the HAL around its center
+ * to the aspect ratio of the stream, scaled to the stream size, then rotated and decimated by the conversion.
+ */
+static void android_camera2_capture_map_faces(AndroidCamera2Context *d, const AndroidCamera2CaptureResult *result, int32_t width, int32_t height, MSAndroidCamera2CaptureFaces *faces) {
+	float cropLeft = 0, cropTop = 0;
+	float cropWidth = (float)d->activeArraySize[2], cropHeight = (float)d->activeArraySize[3];
+	if (result->cropRegion[2] > 0 && result->cropRegion[3] > 0) {
+		cropLeft = (float)result->cropRegion[0];
+		cropTop = (float)result->cropRegion[1];
+		cropWidth = (float)result->cropRegion[2];
+		cropHeight = (float)result->cropRegion[3];
+	}
+	faces->count = 0;
+	if (cropWidth <= 0 || cropHeight <= 0 || width <= 0 || height <= 0) return;
+
+	if (cropWidth * height > cropHeight * width) {
+		float visibleWidth = cropHeight * width / height;
+		cropLeft += (cropWidth - visibleWidth) / 2;
+		cropWidth = visibleWidth;
+	} else {
+		float visibleHeight = cropWidth * height / width;
+		cropTop += (cropHeight - visibleHeight) / 2;
+		cropHeight = visibleHeight;
+	}
+
 	int32_t orientation = android_camera2_capture_get_orientation(d);
+	int decimation = d->outputFormat == MS_ANDROID_CAMERA2_PIX_FMT_GRAY8 ? d->lumaDecimation : 1;
+	for (int i = 0; i < result->faceCount; i++) {
+		const int32_t *rect = result->faceRectangles[i];
+		// In frame pixels, before rotation
+		int left = (int)((rect[0] - cropLeft) * width / cropWidth);
+		int top = (int)((rect[1] - cropTop) * height / cropHeight);
+		int right = (int)((rect[2] - cropLeft) * width / cropWidth);
+		int bottom = (int)((rect[3] - cropTop) * height / cropHeight);
+		left = left < 0 ? 0 : left;
+		top = top < 0 ? 0 : top;
+		right = right > width ? width : right;
+		bottom = bottom > height ? height : bottom;
+		if (right <= left || bottom <= top) continue; // out of the zoomed region
+
+		// Same clockwise rotation as the conversion
+		MSAndroidCamera2CaptureFace *face = &faces->faces[faces->count++];
+		switch (orientation) {
+			case 90:
+				face->x = height - bottom;
+				face->y = left;
+				face->width = bottom - top;
+				face->height = right - left;
+				break;
+			case 180:
+				face->x = width - right;
+				face->y = height - bottom;
+				face->width = right - left;
+				face->height = bottom - top;
+				break;
+			case 270:
+				face->x = top;
+				face->y = width - right;
+				face->width = bottom - top;
+				face->height = right - left;
+				break;
+			default:
+				face->x = left;
+				face->y = top;
+				face->width = right - left;
+				face->height = bottom - top;
+				break;
+		}
+		face->x /= decimation;
+		face->y /= decimation;
+		face->width /= decimation;
+		face->height /= decimation;
+		face->score = result->faceScores[i];
+	}
+}
+
+/*
+ * Scene difference is computed on a decimated grid of the source luma plane: one row out of 16 and, in each of them,
+ * 16 contiguous pixels out of 64. Grid samples of the previous frame are kept to compute the sum of absolute differences.
+ * It is a pass of its own before the conversion, reading one luma row out of 16, as the conversion kernels don't go through
+ * the source rows in order.
+ */
+#define ANDROID_CAMERA2_SCENE_GRID_ROW_STEP 16
+#define ANDROID_CAMERA2_SCENE_GRID_COL_STEP 64
+#define ANDROID_CAMERA2_SCENE_GRID_BLOCK 16
+
+static uint32_t android_camera2_capture_row_sad(const uint8_t *src, uint8_t *previous, int blocks) {
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+	uint16x8_t sum16 = vdupq_n_u16(0);
+	for (int i = 0; i < blocks; i++) {
+		uint8x16_t current = vld1q_u8(src + i * ANDROID_CAMERA2_SCENE_GRID_COL_STEP);
+		uint8x16_t before = vld1q_u8(previous);
+		sum16 = vpadalq_u8(sum16, vabdq_u8(current, before));
+		vst1q_u8(previous, current);
+		previous += ANDROID_CAMERA2_SCENE_GRID_BLOCK;
+	}
+	uint32x4_t sum32 = vpaddlq_u16(sum16);
+	uint64x2_t sum64 = vpaddlq_u32(sum32);
+	return (uint32_t)(vgetq_lane_u64(sum64, 0) + vgetq_lane_u64(sum64, 1));
+#else
+	uint32_t sum = 0;
+	for (int i = 0; i < blocks; i++) {
+		const uint8_t *current = src + i * ANDROID_CAMERA2_SCENE_GRID_COL_STEP;
+		for (int j = 0; j < ANDROID_CAMERA2_SCENE_GRID_BLOCK; j++) {
+			int diff = current[j] - previous[j];
+			sum += diff < 0 ? -diff : diff;
+			previous[j] = current[j];
+		}
+		previous += ANDROID_CAMERA2_SCENE_GRID_BLOCK;
+	}
+	return sum;
+#endif
+}
+
+// Returns the mean absolute difference with the previous frame, or -1 if there is no previous frame to compare with
+static float android_camera2_capture_compute_scene_difference(AndroidCamera2Context *d, const uint8_t *y, int32_t yStride, int32_t width, int32_t height) {
+	int rows = height / ANDROID_CAMERA2_SCENE_GRID_ROW_STEP;
+	// Last block must not read past the end of the row
+	int blocks = (width - ANDROID_CAMERA2_SCENE_GRID_BLOCK) / ANDROID_CAMERA2_SCENE_GRID_COL_STEP + 1;
+	if (rows <= 0 || width < ANDROID_CAMERA2_SCENE_GRID_BLOCK) return -1;
+
+	int gridSize = rows * blocks * ANDROID_CAMERA2_SCENE_GRID_BLOCK;
+	bool hasPrevious = true;
+	if (gridSize != d->sceneGridSize) {
+		if (d->sceneGrid) ms_free(d->sceneGrid);
+		d->sceneGrid = (uint8_t *)ms_malloc0(gridSize);
+		d->sceneGridSize = gridSize;
+		hasPrevious = false;
+	}
+
+	uint64_t sum = 0;
+	uint8_t *previous = d->sceneGrid;
+	for (int row = 0; row < rows; row++) {
+		sum += android_camera2_capture_row_sad(y + row * ANDROID_CAMERA2_SCENE_GRID_ROW_STEP * yStride, previous, blocks);
+		previous += blocks * ANDROID_CAMERA2_SCENE_GRID_BLOCK;
+	}
+	return hasPrevious ? (float)sum / gridSize : -1;
+}
+
+static void android_camera2_capture_get_raw_frame(AImage *image, AndroidCamera2RawFrame *frame) {
+	AImage_getTimestamp(image, &frame->timestamp);
+	AImage_getFormat(image, &frame->format);
+	AImage_getWidth(image, &frame->width);
+	AImage_getHeight(image, &frame->height);
+	AImage_getNumberOfPlanes(image, &frame->planeCount);
+	if (frame->planeCount > ANDROID_CAMERA2_RAW_FRAME_MAX_PLANES) frame->planeCount = ANDROID_CAMERA2_RAW_FRAME_MAX_PLANES;
+
+	for (int i = 0; i < frame->planeCount; i++) {
+		uint8_t *data = nullptr;
+		AImage_getPlaneData(image, i, &data, &frame->planes[i].length);
+		frame->planes[i].data = data;
+		AImage_getPlaneRowStride(image, i, &frame->planes[i].rowStride);
+		AImage_getPlanePixelStride(image, i, &frame->planes[i].pixelStride);
+	}
+}
+
+/* Chooses the conversion kernel for the plane layout, the orientation and the output format, from the converting thread */
+static void android_camera2_capture_select_convert_kernel(AndroidCamera2Context *d) {
+	d->convertKernelDirty = false;
+	android_camera2_converter_select_kernel(&d->converter, android_camera2_capture_get_orientation(d),
+		d->outputFormat == MS_ANDROID_CAMERA2_PIX_FMT_GRAY8, d->lumaDecimation);
+}
+
+/* Probes the layout of a full frame, the kernel is selected again before the next conversion */
+static void android_camera2_capture_set_plane_layout(AndroidCamera2Context *d, const AndroidCamera2RawFrame *frame) {
+	android_camera2_converter_set_plane_layout(&d->converter, frame);
+	d->convertKernelDirty = true;
+}
+
+/*
+ * The plane layout is fixed for an image reader, so once probed only the plane addresses are queried. Their lengths and the
+ * distance between the chroma planes validate the cached layout, which is probed again if they don't match.
+ */
+static void android_camera2_capture_get_image_frame(AndroidCamera2Context *d, AImage *image, AndroidCamera2RawFrame *frame) {
+	const AndroidCamera2PlaneLayout *layout = &d->converter.layout;
+	if (layout->valid) {
+		bool match = true;
+		AImage_getTimestamp(image, &frame->timestamp);
+		for (int i = 0; i < layout->planeCount && match; i++) {
+			uint8_t *data = nullptr;
+			int32_t length = 0;
+			AImage_getPlaneData(image, i, &data, &length);
+			frame->planes[i].data = data;
+			match = length == layout->length[i];
+		}
+		if (match && (layout->planeCount != 3 || frame->planes[2].data - frame->planes[1].data == layout->chromaOffset)) {
+			frame->format = layout->format;
+			frame->width = layout->width;
+			frame->height = layout->height;
+			frame->planeCount = layout->planeCount;
+			for (int i = 0; i < layout->planeCount; i++) {
+				frame->planes[i].length = layout->length[i];
+				frame->planes[i].rowStride = layout->rowStride[i];
+				frame->planes[i].pixelStride = layout->pixelStride[i];
+			}
+			return;
+		}
+		ms_warning("[Camera2 Capture] Image doesn't match the cached plane layout, probing it again");
+	}
+
+	android_camera2_capture_get_raw_frame(image, frame);
+	android_camera2_capture_set_plane_layout(d, frame);
+}
+
+/* Frame comes from the image reader or from a raw dump being replayed, its layout is the cached one */
+static mblk_t* android_camera2_capture_raw_frame_to_mblkt(AndroidCamera2Context *d, const AndroidCamera2RawFrame *frame) {
+	if (d->convertKernelDirty) {
+		android_camera2_capture_select_convert_kernel(d);
+	}
+
+	if (d->sceneDetection.enabled) {
+		d->sceneDifference = android_camera2_capture_compute_scene_difference(d, frame->planes[0].data, frame->planes[0].rowStride, frame->width, frame->height);
+	}
+
+	return android_camera2_converter_convert(&d->converter, frame);
+}
+
+/* ************************************************************************* */
+
+/*
+ * mediastreamer2 has no timed wait on its condition variables. They are pthread ones on Android, so this is the only place
+ * using pthread directly. Waits at most timeout ms, called with mutex held.
+ */
+static void android_camera2_capture_cond_timed_wait(ms_cond_t *cond, ms_mutex_t *mutex, int64_t timeout) {
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_nsec += (long)(timeout * 1000000);
+	deadline.tv_sec += deadline.tv_nsec / 1000000000;
+	deadline.tv_nsec %= 1000000000;
+	pthread_cond_timedwait(cond, mutex, &deadline);
+}
+
+/*
+ * Replaces the ticker sleep between two ticks: a frame queued less than a tick interval before the next tick runs the graph
+ * right away instead of waiting for it. Ticks are never run more than one interval ahead of their time, so the ticker
+ * clock doesn't drift and the rest of the graph keeps its cadence.
+ */
+static int android_camera2_capture_wait_next_tick(void *data, uint64_t virtualTime) {
+	AndroidCamera2Context *d = (AndroidCamera2Context *)data;
+	int64_t diff = 0;
+
+	ms_mutex_lock(&d->mutex);
+	d->pushWaiting = true;
+	d->pushEntered = true;
+	ms_cond_broadcast(&d->pushCond);
+	while (true) {
+		MSTicker *ticker = d->pushTicker;
+		// Being removed, the previous wait function takes over from the next tick
+		if (!ticker) break;
+		uint64_t realTime = ticker->get_cur_time_ptr(ticker->get_cur_time_data) - ticker->orig;
+		diff = (int64_t)virtualTime - (int64_t)realTime;
+		if (diff <= 0) break;
+		if (d->frame && diff <= (int64_t)ticker->interval) break;
+
+		android_camera2_capture_cond_timed_wait(&d->pushCond, &d->mutex, diff < (int64_t)ticker->interval ? diff : (int64_t)ticker->interval);
+	}
+	d->pushWaiting = false;
+	ms_cond_broadcast(&d->pushCond);
+	ms_mutex_unlock(&d->mutex);
+
+	return diff < 0 ? (int)-diff : 0;
+}
+
+/*
+ * The ticker reads its wait function and its data separately, out of its lock: they are only swapped when the ticker thread
+ * can't be reading them. From process(), on the ticker thread, as the push mode and the pacing change, and from
+ * postprocess() once the ticker thread is in the wait function or back from it.
+ */
+static void android_camera2_capture_update_push_mode(AndroidCamera2Context *d, MSTicker *ticker) {
+	bool install = d->pushMode && !d->pacing.enabled;
+	if (d->pushTicker && !install) {
+		ms_ticker_set_tick_func(d->pushTicker, d->previousTickFunc, d->previousTickFuncData);
+		ms_mutex_lock(&d->mutex);
+		d->pushTicker = nullptr;
+		ms_mutex_unlock(&d->mutex);
+		ms_message("[Camera2 Capture] Push mode stopped, frames are sent on ticks");
+	} else if (install && !d->pushTicker) {
+		d->previousTickFunc = ticker->wait_next_tick;
+		d->previousTickFuncData = ticker->wait_next_tick_data;
+		ms_mutex_lock(&d->mutex);
+		d->pushTicker = ticker;
+		ms_mutex_unlock(&d->mutex);
+		ms_ticker_set_tick_func(ticker, android_camera2_capture_wait_next_tick, d);
+		ms_message("[Camera2 Capture] Push mode started on ticker %s, frames are sent as soon as they are converted", ticker->name);
+	}
 
-	AImage_getWidth(image, &width);
-	AImage_getHeight(image, &height);
-	if (orientation % 180 != 0) {
-		int32_t tmp = width;
-		width = height;
-		height = tmp;
+	ms_mutex_lock(&d->mutex);
+	d->pushEntered = false;
+	ms_mutex_unlock(&d->mutex);
+}
+
+/*
+ * Postprocess is called with the ticker lock held, so process() doesn't run again meanwhile. If it ran since the last call
+ * of the wait function, the ticker thread is on its way to call it and is let in first. The context is only freed once
+ * the ticker thread has left the function.
+ */
+static void android_camera2_capture_remove_push_mode(AndroidCamera2Context *d) {
+	ms_mutex_lock(&d->mutex);
+	if (!d->pushTicker) {
+		ms_mutex_unlock(&d->mutex);
+		return;
+	}
+	while (!d->pushEntered) ms_cond_wait(&d->pushCond, &d->mutex);
+	ms_ticker_set_tick_func(d->pushTicker, d->previousTickFunc, d->previousTickFuncData);
+	// Being removed, the ticker thread leaves the function and uses the previous one from the next tick
+	d->pushTicker = nullptr;
+	ms_cond_broadcast(&d->pushCond);
+	while (d->pushWaiting) ms_cond_wait(&d->pushCond, &d->mutex);
+	ms_mutex_unlock(&d->mutex);
+	ms_message("[Camera2 Capture] Push mode stopped, filter is detached from the ticker");
+}
+
+// Called with mutex held
+static void android_camera2_capture_flush_paced_frames(AndroidCamera2Context *d) {
+	for (int i = 0; i < d->pacedFrameCount; i++) {
+		freemsg(d->pacedFrames[i].frame);
+	}
+	d->pacedFrameCount = 0;
+	d->pacingNextEmitTime = 0;
+}
+
+static void android_camera2_capture_flush_frames(AndroidCamera2Context *d) {
+	ms_mutex_lock(&d->mutex);
+	if (d->frame) {
+		freemsg(d->frame);
+		d->frame = NULL;
 	}
+	android_camera2_capture_flush_paced_frames(d);
+	ms_mutex_unlock(&d->mutex);
+}
+
+static void android_camera2_capture_set_last_frame(AndroidCamera2Context *d, mblk_t *m) {
+	if (d->lastFrame) freemsg(d->lastFrame);
+	d->lastFrame = m ? dupmsg(m) : nullptr;
+}
 
-	AImage_getPlaneRowStride(image, 0, &yStride);
-	AImage_getPlaneRowStride(image, 1, &uvStride);
-	AImage_getPlaneData(image, 0, &yPixel, &yLen);
-	AImage_getPlaneData(image, 1, &uPixel, &uLen);
-	AImage_getPlaneData(image, 2, &vPixel, &vLen);
-	AImage_getPlanePixelStride(image, 0, &yPixelStride);
-	AImage_getPlanePixelStride(image, 1, &uvPixelStride);
+static void android_camera2_capture_queue_frame(AndroidCamera2Context *d, mblk_t *m, int64_t timestamp, const MSAndroidCamera2CaptureFaces *faces) {
+	if (d->firstFrameTime == 0 && d->startRequestTime != 0) {
+		d->firstFrameTime = android_camera2_capture_get_time_ms();
+		uint64_t firstHalFrameTime = d->firstHalFrameTime;
+		ms_message("[Camera2 Capture] Time to first frame is %.0fms: preview creation %llums, camera open %llums, session creation %llums, first HAL frame after %llums%s",
+			android_camera2_capture_get_time_to_first_frame(d), (unsigned long long)d->previewCreationDuration, (unsigned long long)d->cameraOpenDuration,
+			(unsigned long long)d->sessionCreationDuration, firstHalFrameTime != 0 ? (unsigned long long)(firstHalFrameTime - d->startRequestTime) : 0ULL,
+			d->sessionCreationDuration == 0 ? " (pre-warmed)" : "");
+	}
 
-	//ms_message("[Camera2 Capture] Image %p size %d/%d, y is %p, u is %p, v is %p, ystride %d, uvstride %d, ypixelstride %d, uvpixelstride %d", image, width, height, yPixel, uPixel, vPixel, yStride, uvStride, yPixelStride, uvPixelStride);
+	if (d->resumeRequestTime != 0) {
+		ms_message("[Camera2 Capture] First frame %llums after resuming", (unsigned long long)(android_camera2_capture_get_time_ms() - d->resumeRequestTime));
+		d->resumeRequestTime = 0;
+	}
 
-	mblk_t* yuv_block = nullptr;
-	if (uvPixelStride == 1) {
-		yuv_block = copy_yuv_with_rotation(d->bufAllocator, yPixel, uPixel, vPixel, orientation, width, height, yStride, uvStride, uvStride);
+	ms_mutex_lock(&d->mutex);
+	if (!d->pacing.enabled) {
+		if (d->frame) {
+			freemsg(d->frame);
+			d->pluginDroppedFrames++;
+		}
+		d->frame = m;
+		d->frameSensorTime = (uint64_t)(timestamp / 1000);
+		// Replayed timestamps are from the time of the dump, the offset is estimated as for sensors with an unknown time base
+		int64_t offset = d->sensorTimestampRealtime && !d->replayReader ? android_camera2_capture_get_boot_time_offset()
+			: (int64_t)android_camera2_capture_get_time_us() - (int64_t)d->frameSensorTime;
+		if (!d->sensorClockOffsetSet || d->sensorTimestampRealtime || offset < d->sensorClockOffset) {
+			d->sensorClockOffset = offset;
+			d->sensorClockOffsetSet = true;
+		}
+		d->frameHasFaces = faces != nullptr;
+		if (faces) d->frameFaces = *faces;
+		if (d->pushTicker) ms_cond_broadcast(&d->pushCond);
 	} else {
-		yuv_block = copy_ycbcrbiplanar_to_true_yuv_with_rotation_and_down_scale_by_2(d->bufAllocator,
-	 		yPixel, vPixel < uPixel ? vPixel : uPixel, orientation, width, height, yStride, uvStride, uPixel < vPixel, false);
+		if (d->pacedFrameCount >= d->pacing.depth) {
+			freemsg(d->pacedFrames[0].frame);
+			memmove(&d->pacedFrames[0], &d->pacedFrames[1], (d->pacedFrameCount - 1) * sizeof(AndroidCamera2PacedFrame));
+			d->pacedFrameCount--;
+			d->pluginDroppedFrames++;
+			// Buffer is overflowing, cadence has drifted away from the sensor clock, start over from the next frame
+			d->pacingNextEmitTime = 0;
+		}
+		AndroidCamera2PacedFrame *paced = &d->pacedFrames[d->pacedFrameCount++];
+		paced->frame = m;
+		paced->hasFaces = faces != nullptr;
+		if (faces) paced->faces = *faces;
+		paced->sensorTime = (uint64_t)(timestamp / 1000000);
+		paced->queuedTime = d->filter->ticker->time;
 	}
-	return yuv_block;
+	ms_mutex_unlock(&d->mutex);
 }
 
-static void android_camera2_capture_on_image_available(void *context, AImageReader *reader) {
-	AndroidCamera2Context *d = static_cast<AndroidCamera2Context *>(context);
+/*
+ * Releases the oldest buffered frame once it is due: a frame is due pacing.latency after the capture time of the first one,
+ * shifted by its sensor timestamp, and never sooner than one frame interval after the previous release.
+ * Called with mutex held.
+ */
+static mblk_t *android_camera2_capture_get_paced_frame(AndroidCamera2Context *d, uint64_t time, uint32_t tickInterval, uint64_t *emitTime, MSAndroidCamera2CaptureFaces *faces, bool *hasFaces) {
+	if (d->pacedFrameCount == 0) return nullptr;
+
+	AndroidCamera2PacedFrame head = d->pacedFrames[0];
+	uint64_t frameInterval = (uint64_t)(1000.f / android_camera2_capture_get_target_fps(d));
+	if (d->pacingNextEmitTime == 0) {
+		d->pacingOffset = (int64_t)head.queuedTime - (int64_t)head.sensorTime + d->pacing.latency;
+		d->pacingNextEmitTime = head.queuedTime;
+	}
+
+	uint64_t dueTime = (uint64_t)((int64_t)head.sensorTime + d->pacingOffset);
+	uint64_t target = dueTime > d->pacingNextEmitTime ? dueTime : d->pacingNextEmitTime;
+	if (time + tickInterval / 2 < target) return nullptr;
+
+	memmove(&d->pacedFrames[0], &d->pacedFrames[1], (d->pacedFrameCount - 1) * sizeof(AndroidCamera2PacedFrame));
+	d->pacedFrameCount--;
+
+	// Late by more than a frame, keep the ticker time instead of bursting to catch up
+	*emitTime = time > target + frameInterval ? time : target;
+	d->pacingNextEmitTime = *emitTime + frameInterval;
+
+	int64_t latency = (int64_t)(time - head.queuedTime) * 1000;
+	int64_t average = d->pacingLatency;
+	d->pacingLatency = average == 0 ? latency : average + (latency - average) / 16;
+	*hasFaces = head.hasFaces;
+	if (head.hasFaces) *faces = head.faces;
+	return head.frame;
+}
+
+// Returns the frame to send, or nullptr if it was dropped
+static mblk_t *android_camera2_capture_apply_scene_detection(AndroidCamera2Context *d, mblk_t *m) {
+	uint64_t time = d->filter->ticker->time;
+	float difference = d->sceneDifference;
+
+	if (difference < 0 || difference > d->sceneDetection.sceneChangeThreshold) {
+		d->sceneChanges++;
+		mblk_set_independent_flag(m, 1);
+	} else if (difference < d->sceneDetection.staticThreshold) {
+		d->staticFrames++;
+		if (!d->sceneDetection.dropStaticFrames) {
+			mblk_set_user_flag(m, 1);
+			return m;
+		}
+		if (time - d->lastNonStaticFrameTime < (uint64_t)d->sceneDetection.keepAliveInterval) {
+			freemsg(m);
+			return nullptr;
+		}
+		// Keep-alive frame
+	}
+
+	d->lastNonStaticFrameTime = time;
+	return m;
+}
+
+/* Result is the one of the capture, nullptr when replaying */
+static void android_camera2_capture_convert_raw_frame(AndroidCamera2Context *d, const AndroidCamera2RawFrame *frame, const AndroidCamera2CaptureResult *result) {
+	const MSAndroidCamera2CaptureFaces *faces = nullptr;
+	if (result && d->faceDetection && d->faceDetectionSupported) {
+		if (result->faceCount >= 0) {
+			android_camera2_capture_map_faces(d, result, frame->width, frame->height, &d->lastFaces);
+		}
+		faces = &d->lastFaces;
+	}
+
+	android_camera2_trace_begin(AndroidCamera2TraceConvert);
+	mblk_t *m = android_camera2_capture_raw_frame_to_mblkt(d, frame);
+	android_camera2_trace_end(AndroidCamera2TraceConvert);
+	d->convertedFrames++;
+	if (m && d->sceneDetection.enabled) {
+		m = android_camera2_capture_apply_scene_detection(d, m);
+	}
+	if (m) {
+		AndroidCamera2TraceScope trace(AndroidCamera2TraceHandoff);
+		android_camera2_capture_queue_frame(d, m, frame->timestamp, faces);
+	}
+}
 
+static void android_camera2_capture_process_image(AndroidCamera2Context *d, AImageReader *reader) {
 	ms_filter_lock(d->filter);
 	if (!d->filter || !d->filter->ticker || !d->configured) {
 		AImage *image = nullptr;
@@ -264,16 +1365,32 @@ static void android_camera2_capture_on_image_available(void *context, AImageRead
 		AImage *image = nullptr;
 		// Using AImageReader_acquireLatestImage will lead to the following log if maxImages given to ImageReader is 1
 		// W/NdkImageReader: Unable to acquire a lockedBuffer, very likely client tries to lock more than maxImages buffers
+		android_camera2_trace_begin(AndroidCamera2TraceAcquire);
 		status = AImageReader_acquireNextImage(reader, &image);
+		android_camera2_trace_end(AndroidCamera2TraceAcquire);
 		if (status == AMEDIA_OK) {
-			if (ms_video_capture_new_frame(&d->fpsControl, d->filter->ticker->time)) {
-				mblk_t *m = android_camera2_capture_image_to_mblkt(d, image);
-				if (m) {
-					ms_mutex_lock(&d->mutex);
-					if (d->frame) freemsg(d->frame);
-					d->frame = m;
-					ms_mutex_unlock(&d->mutex);
+			AndroidCamera2RawFrame frame;
+			AndroidCamera2CaptureResult result;
+			android_camera2_capture_get_image_frame(d, image, &frame);
+			int64_t timestamp = frame.timestamp;
+			result.faceCount = -1;
+			if (d->captureResults.find(timestamp, &result)) {
+				if (d->lastDeliveredFrameNumber >= 0 && result.frameNumber > d->lastDeliveredFrameNumber + 1) {
+					d->undeliveredFrames += result.frameNumber - d->lastDeliveredFrameNumber - 1;
 				}
+				d->lastDeliveredFrameNumber = result.frameNumber;
+			}
+
+			ms_mutex_lock(&d->dumpMutex);
+			if (d->dumpWriter && android_camera2_dump_writer_append(d->dumpWriter, &frame) != 0) {
+				ms_error("[Camera2 Capture] Couldn't append frame to raw dump, stopping it");
+				android_camera2_dump_writer_close(d->dumpWriter);
+				d->dumpWriter = nullptr;
+			}
+			ms_mutex_unlock(&d->dumpMutex);
+
+			if (ms_video_capture_new_frame(&d->fpsControl, d->filter->ticker->time)) {
+				android_camera2_capture_convert_raw_frame(d, &frame, &result);
 			}
 			
 			AImage_delete(image);
@@ -285,10 +1402,235 @@ static void android_camera2_capture_on_image_available(void *context, AImageRead
 	}
 }
 
-/* ************************************************************************* */
+static void android_camera2_capture_on_image_available(void *context, AImageReader *reader) {
+	AndroidCamera2Context *d = static_cast<AndroidCamera2Context *>(context);
+	AndroidCamera2TraceScope trace(AndroidCamera2TraceImageCallback);
+	int64_t start = android_camera2_capture_get_thread_cpu_time();
 
-static void android_camera2_capture_create_preview(AndroidCamera2Context *d) {
-    ms_message("[Camera2 Capture] Creating preview");
+	ms_mutex_lock(&d->mutex);
+	bool workerRunning = d->workerRunning;
+	if (workerRunning) {
+		d->workerPendingImages++;
+		ms_cond_signal(&d->workerCond);
+	}
+	ms_mutex_unlock(&d->mutex);
+
+	if (!workerRunning) {
+		android_camera2_capture_process_image(d, reader);
+		d->conversionCpuTime += android_camera2_capture_get_thread_cpu_time() - start;
+	}
+	d->callbackCpuTime += android_camera2_capture_get_thread_cpu_time() - start;
+}
+
+/* ************************************************************************* */
+
+// Big cores are the ones with the highest max frequency, there is no other portable way to tell them apart
+static int android_camera2_capture_get_big_cores_mask(void) {
+	int maxFrequency = 0;
+	int mask = 0;
+	long cpuCount = sysconf(_SC_NPROCESSORS_CONF);
+	for (int cpu = 0; cpu < cpuCount && cpu < 32; cpu++) {
+		char path[128];
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cpufreq/cpuinfo_max_freq", cpu);
+		FILE *file = fopen(path, "r");
+		if (!file) continue;
+		int frequency = 0;
+		if (fscanf(file, "%d", &frequency) == 1) {
+			if (frequency > maxFrequency) {
+				maxFrequency = frequency;
+				mask = 1 << cpu;
+			} else if (frequency == maxFrequency) {
+				mask |= 1 << cpu;
+			}
+		}
+		fclose(file);
+	}
+	return mask;
+}
+
+static void android_camera2_capture_worker_apply_scheduling(AndroidCamera2Context *d) {
+	pid_t tid = (pid_t)syscall(__NR_gettid);
+
+	int cpuMask = d->workerConfig.cpuMask != 0 ? d->workerConfig.cpuMask : android_camera2_capture_get_big_cores_mask();
+	if (cpuMask != 0) {
+		cpu_set_t cpuSet;
+		CPU_ZERO(&cpuSet);
+		for (int cpu = 0; cpu < 32; cpu++) {
+			if (cpuMask & (1 << cpu)) CPU_SET(cpu, &cpuSet);
+		}
+		if (sched_setaffinity(tid, sizeof(cpuSet), &cpuSet) != 0) {
+			ms_warning("[Camera2 Capture] Couldn't set worker CPU affinity to %x: %s", cpuMask, strerror(errno));
+		} else {
+			ms_message("[Camera2 Capture] Worker CPU affinity set to %x", cpuMask);
+		}
+	}
+
+	if (d->workerConfig.realtime) {
+		struct sched_param param;
+		param.sched_priority = sched_get_priority_min(SCHED_FIFO);
+		if (sched_setscheduler(tid, SCHED_FIFO, &param) == 0) {
+			ms_message("[Camera2 Capture] Worker uses real-time scheduling");
+			return;
+		}
+		ms_warning("[Camera2 Capture] Real-time scheduling refused for worker: %s, using niceness %d", strerror(errno), d->workerConfig.niceness);
+	}
+
+	if (setpriority(PRIO_PROCESS, tid, d->workerConfig.niceness) != 0) {
+		ms_warning("[Camera2 Capture] Couldn't set worker niceness to %d: %s", d->workerConfig.niceness, strerror(errno));
+	}
+}
+
+static void *android_camera2_capture_worker_thread(void *arg) {
+	AndroidCamera2Context *d = (AndroidCamera2Context *)arg;
+	ms_message("[Camera2 Capture] Conversion worker started");
+	android_camera2_capture_worker_apply_scheduling(d);
+
+	ms_mutex_lock(&d->mutex);
+	while (d->workerRunning) {
+		if (d->workerPendingImages == 0) {
+			ms_cond_wait(&d->workerCond, &d->mutex);
+			continue;
+		}
+		d->workerPendingImages--;
+		ms_mutex_unlock(&d->mutex);
+
+		int64_t start = android_camera2_capture_get_thread_cpu_time();
+		android_camera2_capture_process_image(d, d->imageReader);
+		d->conversionCpuTime += android_camera2_capture_get_thread_cpu_time() - start;
+
+		ms_mutex_lock(&d->mutex);
+	}
+	ms_mutex_unlock(&d->mutex);
+
+	ms_message("[Camera2 Capture] Conversion worker stopped");
+	ms_thread_exit(NULL);
+	return NULL;
+}
+
+static void android_camera2_capture_start_worker(AndroidCamera2Context *d) {
+	if (!d->workerConfig.enabled || d->workerRunning) return;
+
+	d->workerPendingImages = 0;
+	d->workerRunning = true;
+	if (ms_thread_create(&d->workerThread, NULL, android_camera2_capture_worker_thread, d) != 0) {
+		ms_error("[Camera2 Capture] Couldn't create conversion worker, converting in image reader callback");
+		d->workerRunning = false;
+	}
+}
+
+static void android_camera2_capture_stop_worker(AndroidCamera2Context *d) {
+	if (!d->workerRunning) return;
+
+	ms_mutex_lock(&d->mutex);
+	d->workerRunning = false;
+	ms_cond_signal(&d->workerCond);
+	ms_mutex_unlock(&d->mutex);
+	ms_thread_join(d->workerThread, NULL);
+}
+
+/* ************************************************************************* */
+
+/* Feeds the frames of a raw dump to the conversion and handoff, in place of the image reader */
+static void *android_camera2_capture_replay_thread(void *arg) {
+	AndroidCamera2Context *d = (AndroidCamera2Context *)arg;
+	AndroidCamera2RawFrame frame;
+	int64_t firstTimestamp = -1;
+	uint64_t firstTime = 0;
+	uint64_t startTime = android_camera2_capture_get_time_ms();
+	int replayedFrames = 0;
+	int passFrames = 0; // converted in the current pass
+	int passUsableFrames = 0; // in a format that can be converted
+
+	ms_message("[Camera2 Capture] Replay started%s", d->replay.maxSpeed ? " at maximum speed" : "");
+	while (d->replayRunning) {
+		// Cleared before checking the pause, so a suspend either sees the thread busy or the thread sees the pause
+		d->replayIdle = false;
+		if (d->replayPaused) {
+			// Timing starts over from the current position on resume
+			d->replayIdle = true;
+			firstTimestamp = -1;
+			ms_usleep(10000);
+			continue;
+		}
+		if (!android_camera2_dump_reader_next(d->replayReader, &frame)) {
+			if (!d->replay.loop) break;
+			if (passUsableFrames == 0) {
+				ms_error("[Camera2 Capture] No frame of the raw dump can be converted, stopping replay");
+				break;
+			}
+			// Every frame dropped by the fps control, don't spin over the dump
+			if (passFrames == 0) ms_usleep(10000);
+			android_camera2_dump_reader_rewind(d->replayReader);
+			firstTimestamp = -1;
+			passFrames = 0;
+			passUsableFrames = 0;
+			continue;
+		}
+		if (frame.format != ANDROID_CAMERA2_RAW_FORMAT_YUV_420_888 || frame.planeCount != 3) {
+			ms_error("[Camera2 Capture] Skipping replayed frame in format %d with %d planes", frame.format, frame.planeCount);
+			continue;
+		}
+		// Frames of a dump carry their whole layout, no NDK call to save, just make sure the kernel matches
+		if (!android_camera2_converter_layout_matches(&d->converter, &frame)) {
+			android_camera2_capture_set_plane_layout(d, &frame);
+		}
+		passUsableFrames++;
+
+		if (!d->replay.maxSpeed) {
+			if (firstTimestamp < 0) {
+				firstTimestamp = frame.timestamp;
+				firstTime = android_camera2_capture_get_time_ms();
+			}
+			uint64_t target = firstTime + (uint64_t)((frame.timestamp - firstTimestamp) / 1000000);
+			uint64_t now = android_camera2_capture_get_time_ms();
+			while (now < target && d->replayRunning && !d->replayPaused) {
+				ms_usleep((target - now < 50 ? target - now : 50) * 1000);
+				now = android_camera2_capture_get_time_ms();
+			}
+			if (d->replayPaused) continue;
+			if (!ms_video_capture_new_frame(&d->fpsControl, d->filter->ticker->time)) continue;
+		}
+
+		int64_t start = android_camera2_capture_get_thread_cpu_time();
+		android_camera2_capture_convert_raw_frame(d, &frame, nullptr);
+		d->conversionCpuTime += android_camera2_capture_get_thread_cpu_time() - start;
+		replayedFrames++;
+		passFrames++;
+	}
+
+	d->replayIdle = true;
+	uint64_t duration = android_camera2_capture_get_time_ms() - startTime;
+	ms_message("[Camera2 Capture] Replay stopped, %d frames converted in %llums (%.1f fps)", replayedFrames, (unsigned long long)duration,
+		duration > 0 ? replayedFrames * 1000.f / duration : 0.f);
+	ms_thread_exit(NULL);
+	return NULL;
+}
+
+static void android_camera2_capture_start_replay(AndroidCamera2Context *d) {
+	if (d->replayRunning) return;
+
+	android_camera2_dump_reader_rewind(d->replayReader);
+	d->converter.layout.valid = false;
+	d->replayRunning = true;
+	d->replayPaused = d->suspended;
+	d->replayIdle = false;
+	if (ms_thread_create(&d->replayThread, NULL, android_camera2_capture_replay_thread, d) != 0) {
+		ms_error("[Camera2 Capture] Couldn't create replay thread");
+		d->replayRunning = false;
+	}
+}
+
+static void android_camera2_capture_stop_replay(AndroidCamera2Context *d) {
+	if (!d->replayRunning) return;
+
+	d->replayRunning = false;
+	ms_thread_join(d->replayThread, NULL);
+}
+
+/* ************************************************************************* */
+
+static void android_camera2_capture_create_preview(AndroidCamera2Context *d) {
+    ms_message("[Camera2 Capture] Creating preview");
    	JNIEnv *jenv = ms_get_jni_env();
 
 	if (!d->surface) {
@@ -326,7 +1668,9 @@ static void android_camera2_capture_open_camera(AndroidCamera2Context *d) {
 	}
 
 	ACameraDevice *cameraDevice;
+	android_camera2_trace_begin(AndroidCamera2TraceCameraOpen);
 	camera_status_t camera_status = ACameraManager_openCamera(d->cameraManager, d->device->camId, &d->deviceStateCallbacks, &cameraDevice);
+	android_camera2_trace_end(AndroidCamera2TraceCameraOpen);
 	if (camera_status != ACAMERA_OK) {
 		ms_error("[Camera2 Capture] Failed to open camera %s, error is %s", d->device->camId, android_camera2_status_to_string(camera_status));
 		return;
@@ -351,6 +1695,11 @@ static void android_camera2_capture_close_camera(AndroidCamera2Context *d) {
 }
 
 static void android_camera2_check_configuration_ok(AndroidCamera2Context *d) {
+	if (d->replayReader) {
+		// No camera nor preview involved
+		d->configured = d->captureSize.width != 0 && d->captureSize.height != 0;
+		return;
+	}
 	if (d->nativeWindowId == 0) {
 		ms_error("[Camera2 Capture] TextureView wasn't set (was core.setNativePreviewWindowId() called?)");
 		return;
@@ -366,141 +1715,198 @@ static void android_camera2_check_configuration_ok(AndroidCamera2Context *d) {
 	d->configured = true;
 }
 
-static void android_camera2_capture_start(AndroidCamera2Context *d) {
-	ms_message("[Camera2 Capture] Starting capture");
-	camera_status_t camera_status = ACAMERA_OK;
-
-	if (d->capturing) {
-		ms_warning("[Camera2 Capture] Capture was already started, ignoring...");
-		return;
-	}
-	if (!d->configured) {
-		ms_warning("[Camera2 Capture] Filter configuration not finished, ignoring...");
-		return;
-	}
-	
-	if (!d->nativeWindow && d->surface) {
-		android_camera2_capture_create_preview(d);
+static const char* android_camera2_capture_profile_to_string(MSAndroidCamera2CaptureProfile profile) {
+	switch (profile) {
+		case MSAndroidCamera2CaptureProfileLowLatency:
+			return "low-latency";
+		case MSAndroidCamera2CaptureProfileBalanced:
+			return "balanced";
+		case MSAndroidCamera2CaptureProfileQuality:
+			return "quality";
+		case MSAndroidCamera2CaptureProfileDefault:
+			return "default";
 	}
-	if (!d->cameraDevice) {
-		android_camera2_capture_open_camera(d);
+	return "unknown";
+}
+
+static ACameraDevice_request_template android_camera2_capture_profile_to_template(MSAndroidCamera2CaptureProfile profile) {
+	if (profile == MSAndroidCamera2CaptureProfileLowLatency) {
+		return TEMPLATE_PREVIEW;
 	}
+	return TEMPLATE_RECORD;
+}
 
-	if (!d->cameraDevice) {
-		ms_error("[Camera2 Capture] Couldn't open camera %s, aborting capture",  d->device->camId);
+static void android_camera2_capture_set_request_mode(ACaptureRequest *request, uint32_t tag, const char *name, uint32_t availableModes, uint8_t mode) {
+	if ((availableModes & (1 << mode)) == 0) {
+		ms_message("[Camera2 Capture] Mode %d for %s isn't supported by device, keeping template value", mode, name);
 		return;
 	}
-
-	camera_status = ACaptureSessionOutputContainer_create(&d->captureSessionOutputContainer);
+	camera_status_t camera_status = ACaptureRequest_setEntry_u8(request, tag, 1, &mode);
 	if (camera_status != ACAMERA_OK) {
-		ms_error("[Camera2 Capture] Failed to create capture session output container, error is %s", android_camera2_status_to_string(camera_status));
+		ms_error("[Camera2 Capture] Failed to set %s to %d, error is %s", name, mode, android_camera2_status_to_string(camera_status));
 	}
-	d->captureSessionStateCallbacks.onReady = android_camera2_capture_session_on_ready;
-	d->captureSessionStateCallbacks.onActive = android_camera2_capture_session_on_active;
-	d->captureSessionStateCallbacks.onClosed = android_camera2_capture_session_on_closed;
+}
 
-	camera_status = ACameraDevice_createCaptureRequest(d->cameraDevice, TEMPLATE_RECORD, &d->capturePreviewRequest);
-	if (camera_status != ACAMERA_OK) {
-		ms_error("[Camera2 Capture] Failed to create capture preview request, error is %s", android_camera2_status_to_string(camera_status));
-	}
+static void android_camera2_capture_apply_profile(AndroidCamera2Context *d) {
+	uint8_t noiseReductionMode = ACAMERA_NOISE_REDUCTION_MODE_FAST;
+	uint8_t edgeMode = ACAMERA_EDGE_MODE_FAST;
+	uint8_t videoStabilizationMode = ACAMERA_CONTROL_VIDEO_STABILIZATION_MODE_OFF;
 
-	camera_status = ACameraOutputTarget_create(d->nativeWindow, &d->cameraPreviewOutputTarget);
-	if (camera_status != ACAMERA_OK) {
-		ms_error("[Camera2 Capture] Failed to create output target, error is %s", android_camera2_status_to_string(camera_status));
-	}
+	bool useTemplate = d->profile == MSAndroidCamera2CaptureProfileDefault;
 
-	camera_status = ACaptureRequest_addTarget(d->capturePreviewRequest, d->cameraPreviewOutputTarget);
-	if (camera_status != ACAMERA_OK) {
-		ms_error("[Camera2 Capture] Failed to add output target to capture request, error is %s", android_camera2_status_to_string(camera_status));
+	if (d->profile == MSAndroidCamera2CaptureProfileQuality) {
+		noiseReductionMode = ACAMERA_NOISE_REDUCTION_MODE_HIGH_QUALITY;
+		edgeMode = ACAMERA_EDGE_MODE_HIGH_QUALITY;
+		videoStabilizationMode = ACAMERA_CONTROL_VIDEO_STABILIZATION_MODE_ON;
 	}
 
-	camera_status = ACaptureSessionOutput_create(d->nativeWindow, &d->sessionPreviewOutput);
-	if (camera_status != ACAMERA_OK) {
-		ms_error("[Camera2 Capture] Failed to create capture session output, error is %s", android_camera2_status_to_string(camera_status));
+	if (!useTemplate) {
+		android_camera2_capture_set_request_mode(d->capturePreviewRequest, ACAMERA_NOISE_REDUCTION_MODE, "noise reduction mode", d->availableNoiseReductionModes, noiseReductionMode);
+		android_camera2_capture_set_request_mode(d->capturePreviewRequest, ACAMERA_EDGE_MODE, "edge mode", d->availableEdgeModes, edgeMode);
 	}
-
-	camera_status = ACaptureSessionOutputContainer_add(d->captureSessionOutputContainer, d->sessionPreviewOutput);
-	if (camera_status != ACAMERA_OK) {
-		ms_error("[Camera2 Capture] Failed to add capture session output to container, error is %s", android_camera2_status_to_string(camera_status));
+	if (d->highFrameRateRangeIndex >= 0 && (useTemplate || videoStabilizationMode != ACAMERA_CONTROL_VIDEO_STABILIZATION_MODE_OFF)) {
+		// Stabilization usually caps the sensor at 30 fps
+		ms_message("[Camera2 Capture] Video stabilization disabled for high frame rate");
+		videoStabilizationMode = ACAMERA_CONTROL_VIDEO_STABILIZATION_MODE_OFF;
+		useTemplate = false;
+	}
+	if (!useTemplate) {
+		android_camera2_capture_set_request_mode(d->capturePreviewRequest, ACAMERA_CONTROL_VIDEO_STABILIZATION_MODE, "video stabilization mode", d->availableVideoStabilizationModes, videoStabilizationMode);
 	}
 
-	media_status_t status = AImageReader_new(d->captureSize.width, d->captureSize.height, d->captureFormat, 1, &d->imageReader);
-	if (status != AMEDIA_OK) {
-		ms_error("[Camera2 Capture] Failed to create image reader, error is %i", status);
-		return;
+	ms_message("[Camera2 Capture] Using %s capture profile, device pipeline max depth is %d", android_camera2_capture_profile_to_string(d->profile), d->pipelineMaxDepth);
+}
+
+/*
+ * Crop region is expressed in active array coordinates. It keeps the capture stream aspect ratio, otherwise the HAL
+ * would crop it again to fit the stream, and is scaled by the ISP to the stream size before reaching the image reader.
+ */
+static bool android_camera2_capture_compute_crop_region(AndroidCamera2Context *d, int32_t cropRegion[4]) {
+	int32_t arrayWidth = d->activeArraySize[2];
+	int32_t arrayHeight = d->activeArraySize[3];
+	if (arrayWidth == 0 || arrayHeight == 0 || d->captureSize.width == 0 || d->captureSize.height == 0) {
+		return false;
 	}
-	ms_message("[Camera2 Capture] Created image reader for size %ix%i and format %d", d->captureSize.width, d->captureSize.height, d->captureFormat);
 
-	d->imageReaderListener = new AImageReader_ImageListener();
-	d->imageReaderListener->context = d;
-	d->imageReaderListener->onImageAvailable = android_camera2_capture_on_image_available;
-  	status = AImageReader_setImageListener(d->imageReader, d->imageReaderListener);
-	if (status != AMEDIA_OK) {
-		ms_error("[Camera2 Capture] Failed to set image listener, error is %i", status);
-		return;
+	float factor = d->zoom.factor;
+	if (factor < 1) factor = 1;
+	if (factor > d->maxDigitalZoom) factor = d->maxDigitalZoom;
+
+	int32_t width = arrayWidth;
+	int32_t height = arrayHeight;
+	if ((int64_t)d->captureSize.width * arrayHeight > (int64_t)arrayWidth * d->captureSize.height) {
+		height = (int32_t)((int64_t)arrayWidth * d->captureSize.height / d->captureSize.width);
+	} else {
+		width = (int32_t)((int64_t)arrayHeight * d->captureSize.width / d->captureSize.height);
 	}
+	width = (int32_t)(width / factor);
+	height = (int32_t)(height / factor);
+
+	int32_t left = (int32_t)(arrayWidth * d->zoom.centerX) - width / 2;
+	int32_t top = (int32_t)(arrayHeight * d->zoom.centerY) - height / 2;
+	if (left < 0) left = 0;
+	if (top < 0) top = 0;
+	if (left + width > arrayWidth) left = arrayWidth - width;
+	if (top + height > arrayHeight) top = arrayHeight - height;
+
+	cropRegion[0] = left;
+	cropRegion[1] = top;
+	cropRegion[2] = width;
+	cropRegion[3] = height;
+	return true;
+}
 
-	status = AImageReader_getWindow(d->imageReader, &d->captureWindow);
-	if (status != AMEDIA_OK) {
-		ms_error("[Camera2 Capture] Capture window couldn't be acquired, error is %i", status);
+static void android_camera2_capture_apply_crop_region(AndroidCamera2Context *d) {
+	int32_t cropRegion[4];
+	if (!android_camera2_capture_compute_crop_region(d, cropRegion)) {
 		return;
 	}
-	ANativeWindow_acquire(d->captureWindow);
 
-	camera_status = ACameraOutputTarget_create(d->captureWindow, &d->cameraCaptureOutputTarget);
+	camera_status_t camera_status = ACaptureRequest_setEntry_i32(d->capturePreviewRequest, ACAMERA_SCALER_CROP_REGION, 4, cropRegion);
 	if (camera_status != ACAMERA_OK) {
-		ms_error("[Camera2 Capture] Couldn't create output target, error is %s", android_camera2_status_to_string(camera_status));
+		ms_error("[Camera2 Capture] Failed to set crop region, error is %s", android_camera2_status_to_string(camera_status));
 		return;
 	}
+	ms_message("[Camera2 Capture] Crop region is %dx%d at %d,%d for zoom %f", cropRegion[2], cropRegion[3], cropRegion[0], cropRegion[1], d->zoom.factor);
+}
 
-	camera_status = ACaptureRequest_addTarget(d->capturePreviewRequest, d->cameraCaptureOutputTarget);
+static void android_camera2_capture_apply_face_detection(AndroidCamera2Context *d) {
+	if (!d->faceDetectionSupported) return;
+
+	uint8_t mode = d->faceDetection ? ACAMERA_STATISTICS_FACE_DETECT_MODE_SIMPLE : ACAMERA_STATISTICS_FACE_DETECT_MODE_OFF;
+	camera_status_t camera_status = ACaptureRequest_setEntry_u8(d->capturePreviewRequest, ACAMERA_STATISTICS_FACE_DETECT_MODE, 1, &mode);
 	if (camera_status != ACAMERA_OK) {
-		ms_error("[Camera2 Capture] Couldn't add output target to capture request, error is %s", android_camera2_status_to_string(camera_status));
+		ms_error("[Camera2 Capture] Failed to set face detection mode, error is %s", android_camera2_status_to_string(camera_status));
 		return;
 	}
+	ms_message("[Camera2 Capture] Face detection is %s", d->faceDetection ? "enabled" : "disabled");
+}
 
-	camera_status = ACaptureSessionOutput_create(d->captureWindow, &d->sessionCaptureOutput);
+/* Puts back the template fps range and frame duration that a high frame rate range may have replaced */
+static void android_camera2_capture_restore_template_frame_rate(AndroidCamera2Context *d) {
+	camera_status_t camera_status;
+	if (d->hasTemplateFpsRange) {
+		camera_status = ACaptureRequest_setEntry_i32(d->capturePreviewRequest, ACAMERA_CONTROL_AE_TARGET_FPS_RANGE, 2, d->templateFpsRange);
+	} else {
+		camera_status = ACaptureRequest_setEntry_i32(d->capturePreviewRequest, ACAMERA_CONTROL_AE_TARGET_FPS_RANGE, 0, NULL);
+	}
 	if (camera_status != ACAMERA_OK) {
-		ms_error("[Camera2 Capture] Couldn't create capture session output, error is %s", android_camera2_status_to_string(camera_status));
-		return;
+		ms_error("[Camera2 Capture] Failed to restore template fps range, error is %s", android_camera2_status_to_string(camera_status));
 	}
-
-	camera_status = ACaptureSessionOutputContainer_add(d->captureSessionOutputContainer, d->sessionCaptureOutput);
+	camera_status = ACaptureRequest_setEntry_i64(d->capturePreviewRequest, ACAMERA_SENSOR_FRAME_DURATION, 0, NULL);
 	if (camera_status != ACAMERA_OK) {
-		ms_error("[Camera2 Capture] Couldn't add capture session output to container, error is %s", android_camera2_status_to_string(camera_status));
-		return;
+		ms_error("[Camera2 Capture] Failed to clear sensor frame duration, error is %s", android_camera2_status_to_string(camera_status));
 	}
+}
 
-	camera_status = ACameraDevice_createCaptureSession(d->cameraDevice, d->captureSessionOutputContainer, &d->captureSessionStateCallbacks, &d->captureSession);
-	if (camera_status != ACAMERA_OK) {
-		ms_error("[Camera2 Capture] Couldn't create capture session, error is %s", android_camera2_status_to_string(camera_status));
+/* Programs the current high frame rate range, the frame duration is only used by the sensor with AE off but keeps the request consistent */
+static void android_camera2_capture_apply_frame_rate(AndroidCamera2Context *d) {
+	if (d->highFrameRateRangeIndex < 0) {
+		if (d->highFrameRate.activeFps != 0) {
+			android_camera2_capture_restore_template_frame_rate(d);
+			d->highFrameRate.activeFps = 0;
+			ms_video_init_framerate_controller(&d->fpsControl, d->fps);
+		}
 		return;
 	}
 
-	camera_status = ACameraCaptureSession_setRepeatingRequest(d->captureSession, NULL, 1, &d->capturePreviewRequest, NULL);
+	int32_t *range = d->highFrameRateRanges[d->highFrameRateRangeIndex];
+	camera_status_t camera_status = ACaptureRequest_setEntry_i32(d->capturePreviewRequest, ACAMERA_CONTROL_AE_TARGET_FPS_RANGE, 2, range);
 	if (camera_status != ACAMERA_OK) {
-		ms_error("[Camera2 Capture] Couldn't set capture session repeating request, error is %s", android_camera2_status_to_string(camera_status));
+		ms_error("[Camera2 Capture] Failed to set fps range [%d-%d], error is %s", range[0], range[1], android_camera2_status_to_string(camera_status));
+		d->highFrameRateRangeIndex = -1;
+		android_camera2_capture_apply_frame_rate(d);
 		return;
 	}
+	int64_t frameDuration = 1000000000LL / range[1];
+	camera_status = ACaptureRequest_setEntry_i64(d->capturePreviewRequest, ACAMERA_SENSOR_FRAME_DURATION, 1, &frameDuration);
+	if (camera_status != ACAMERA_OK) {
+		ms_error("[Camera2 Capture] Failed to set sensor frame duration, error is %s", android_camera2_status_to_string(camera_status));
+	}
 
-	d->capturing = true;
-	ms_message("[Camera2 Capture] Capture started");
+	d->highFrameRate.activeFps = range[1];
+	d->highFrameRate.deliveredFps = 0;
+	d->highFrameRateCheckTime = 0;
+	d->highFrameRateSettling = true;
+	d->highFrameRateConfirmed = false;
+	d->highFrameRateMissedChecks = 0;
+	d->highFrameRateExhausted = false;
+	ms_video_init_framerate_controller(&d->fpsControl, (float)range[1]);
+	ms_message("[Camera2 Capture] High frame rate fps range is [%d-%d], frame duration %lldns", range[0], range[1], (long long)frameDuration);
 }
 
-static void android_camera2_capture_stop(AndroidCamera2Context *d) {
-	ms_message("[Camera2 Capture] Stopping capture");
-
-	ms_filter_lock(d->filter);
-	d->configured = false;
-	ms_filter_unlock(d->filter);
+static camera_status_t android_camera2_capture_set_repeating_request(AndroidCamera2Context *d) {
+	// Live request updates must not restart a suspended sensor, resume will use the updated request
+	if (d->suspended) return ACAMERA_OK;
 
-	if (!d->capturing) {
-		ms_warning("[Camera2 Capture] Capture was already stopped, ignoring...");
-		ms_filter_unlock(d->filter);
-		return;
+	camera_status_t camera_status = ACameraCaptureSession_setRepeatingRequest(d->captureSession, &d->captureCallbacks, 1, &d->capturePreviewRequest, NULL);
+	if (camera_status != ACAMERA_OK) {
+		ms_error("[Camera2 Capture] Couldn't set capture session repeating request, error is %s", android_camera2_status_to_string(camera_status));
 	}
-	d->capturing = false;
+	return camera_status;
+}
 
+static void android_camera2_capture_release_session(AndroidCamera2Context *d) {
 	if (d->captureSession) {
 		camera_status_t camera_status = ACameraCaptureSession_abortCaptures(d->captureSession);
 		if (camera_status != ACAMERA_OK) {
@@ -554,7 +1960,13 @@ static void android_camera2_capture_stop(AndroidCamera2Context *d) {
 		d->captureSessionOutputContainer = nullptr;
 	}
 
-	android_camera2_capture_close_camera(d);
+	android_camera2_manager_remove_active_capture(d);
+}
+
+static void android_camera2_capture_release_image_reader(AndroidCamera2Context *d) {
+	android_camera2_capture_stop_worker(d);
+	// Next reader may deliver images with other strides
+	d->converter.layout.valid = false;
 
 	if (d->imageReader) {
 		AImageReader_delete(d->imageReader);
@@ -565,331 +1977,1488 @@ static void android_camera2_capture_stop(AndroidCamera2Context *d) {
 			d->imageReaderListener = nullptr;
 		}
 	}
-
-	android_camera2_capture_destroy_preview(d);
-
-	ms_message("[Camera2 Capture] Capture stopped");
 }
 
-/* ************************************************************************* */
-
-static void android_camera2_capture_init(MSFilter *f) {
-	ms_message("[Camera2 Capture] Filter init");
-	AndroidCamera2Context* d = new AndroidCamera2Context(f);
-	f->data = d;
-}
+typedef camera_status_t (*ACameraDevice_isSessionConfigurationSupported_func)(const ACameraDevice *device, const ACaptureSessionOutputContainer *container);
 
-static void android_camera2_capture_preprocess(MSFilter *f) {
-	ms_message("[Camera2 Capture] Filter preprocess");
-	AndroidCamera2Context *d = (AndroidCamera2Context *)f->data;
+/* Everything but the repeating request, which is what actually starts the sensor */
+static bool android_camera2_capture_create_session(AndroidCamera2Context *d) {
+	camera_status_t camera_status = ACAMERA_OK;
+	uint64_t time = android_camera2_capture_get_time_ms();
 
-	ms_filter_lock(f);
-	ms_video_init_framerate_controller(&d->fpsControl, d->fps);
-	ms_video_init_average_fps(&d->averageFps, d->fps_context);
-	ms_filter_unlock(f);
+	d->previewCreationDuration = 0;
+	d->cameraOpenDuration = 0;
+	d->sessionCreationDuration = 0;
 
-	ms_mutex_lock(&d->mutex);
-	if (d->frame) {
-		freemsg(d->frame);
-		d->frame = NULL;
+	int others = android_camera2_manager_add_active_capture(d, d->device->camId);
+	if (others < 0) {
+		ms_error("[Camera2 Capture] Camera %s is already capturing in another filter", d->device->camId);
+		return false;
+	}
+	// Capture size was chosen with the captures running at configuration time, see android_camera2_capture_limit_capture_size()
+	d->concurrentCapture = others > 0;
+	if (d->concurrentCapture) {
+		ms_message("[Camera2 Capture] %d other camera(s) capturing, capture size is %ix%i%s", others, d->captureSize.width, d->captureSize.height,
+			d->concurrentSizeLimited ? ", limited for concurrent capture" : "");
 	}
-	ms_mutex_unlock(&d->mutex);
-}
-
-static void android_camera2_capture_process(MSFilter *f) {
-	AndroidCamera2Context *d = (AndroidCamera2Context *)f->data;
-	ms_filter_lock(f);
 
-	if (!d->capturing && d->configured) {
-		android_camera2_capture_start(d);
+	if (!d->nativeWindow && d->surface) {
+		android_camera2_capture_create_preview(d);
+		d->previewCreationDuration = android_camera2_capture_get_time_ms() - time;
+	}
+	if (!d->cameraDevice) {
+		time = android_camera2_capture_get_time_ms();
+		android_camera2_capture_open_camera(d);
+		d->cameraOpenDuration = android_camera2_capture_get_time_ms() - time;
 	}
 
-	ms_mutex_lock(&d->mutex);
-	if (d->frame) {
-		ms_video_update_average_fps(&d->averageFps, f->ticker->time);
-		mblk_set_timestamp_info(d->frame, f->ticker->time * 90);
-		ms_queue_put(f->outputs[0], d->frame);
-		d->frame = nullptr;
+	if (!d->cameraDevice) {
+		ms_error("[Camera2 Capture] Couldn't open camera %s, aborting capture",  d->device->camId);
+		return false;
 	}
-	ms_mutex_unlock(&d->mutex);
 
-	ms_filter_unlock(f);
-}
+	time = android_camera2_capture_get_time_ms();
 
-static void android_camera2_capture_postprocess(MSFilter *f) {
-	ms_message("[Camera2 Capture] Filter postprocess");
-	AndroidCamera2Context *d = (AndroidCamera2Context *)f->data;
+	camera_status = ACaptureSessionOutputContainer_create(&d->captureSessionOutputContainer);
+	if (camera_status != ACAMERA_OK) {
+		ms_error("[Camera2 Capture] Failed to create capture session output container, error is %s", android_camera2_status_to_string(camera_status));
+	}
+	d->captureSessionStateCallbacks.onReady = android_camera2_capture_session_on_ready;
+	d->captureSessionStateCallbacks.onActive = android_camera2_capture_session_on_active;
+	d->captureSessionStateCallbacks.onClosed = android_camera2_capture_session_on_closed;
 
-	if (d->capturing) {
-		android_camera2_capture_stop(d);
+	camera_status = ACameraDevice_createCaptureRequest(d->cameraDevice, android_camera2_capture_profile_to_template(d->profile), &d->capturePreviewRequest);
+	if (camera_status != ACAMERA_OK) {
+		ms_error("[Camera2 Capture] Failed to create capture preview request, error is %s", android_camera2_status_to_string(camera_status));
+	} else {
+		ACameraMetadata_const_entry fpsRange;
+		d->hasTemplateFpsRange = ACaptureRequest_getConstEntry(d->capturePreviewRequest, ACAMERA_CONTROL_AE_TARGET_FPS_RANGE, &fpsRange) == ACAMERA_OK
+			&& fpsRange.count == 2;
+		if (d->hasTemplateFpsRange) {
+			d->templateFpsRange[0] = fpsRange.data.i32[0];
+			d->templateFpsRange[1] = fpsRange.data.i32[1];
+		}
+		android_camera2_capture_apply_profile(d);
+		android_camera2_capture_apply_crop_region(d);
+		android_camera2_capture_apply_face_detection(d);
+		android_camera2_capture_apply_frame_rate(d);
 	}
 
-	ms_mutex_lock(&d->mutex);
-	if (d->frame) {
-		freemsg(d->frame);
-		d->frame = NULL;
+	camera_status = ACameraOutputTarget_create(d->nativeWindow, &d->cameraPreviewOutputTarget);
+	if (camera_status != ACAMERA_OK) {
+		ms_error("[Camera2 Capture] Failed to create output target, error is %s", android_camera2_status_to_string(camera_status));
 	}
-	ms_mutex_unlock(&d->mutex);
-}
+
+	camera_status = ACaptureRequest_addTarget(d->capturePreviewRequest, d->cameraPreviewOutputTarget);
+	if (camera_status != ACAMERA_OK) {
+		ms_error("[Camera2 Capture] Failed to add output target to capture request, error is %s", android_camera2_status_to_string(camera_status));
+	}
+
+	camera_status = ACaptureSessionOutput_create(d->nativeWindow, &d->sessionPreviewOutput);
+	if (camera_status != ACAMERA_OK) {
+		ms_error("[Camera2 Capture] Failed to create capture session output, error is %s", android_camera2_status_to_string(camera_status));
+	}
+
+	camera_status = ACaptureSessionOutputContainer_add(d->captureSessionOutputContainer, d->sessionPreviewOutput);
+	if (camera_status != ACAMERA_OK) {
+		ms_error("[Camera2 Capture] Failed to add capture session output to container, error is %s", android_camera2_status_to_string(camera_status));
+	}
+
+	media_status_t status = AImageReader_new(d->captureSize.width, d->captureSize.height, d->captureFormat, 1, &d->imageReader);
+	if (status != AMEDIA_OK) {
+		ms_error("[Camera2 Capture] Failed to create image reader, error is %i", status);
+		return false;
+	}
+	ms_message("[Camera2 Capture] Created image reader for size %ix%i and format %d", d->captureSize.width, d->captureSize.height, d->captureFormat);
+
+	d->imageReaderListener = new AImageReader_ImageListener();
+	d->imageReaderListener->context = d;
+	d->imageReaderListener->onImageAvailable = android_camera2_capture_on_image_available;
+  	status = AImageReader_setImageListener(d->imageReader, d->imageReaderListener);
+	if (status != AMEDIA_OK) {
+		ms_error("[Camera2 Capture] Failed to set image listener, error is %i", status);
+		return false;
+	}
+
+	status = AImageReader_getWindow(d->imageReader, &d->captureWindow);
+	if (status != AMEDIA_OK) {
+		ms_error("[Camera2 Capture] Capture window couldn't be acquired, error is %i", status);
+		return false;
+	}
+	ANativeWindow_acquire(d->captureWindow);
+
+	camera_status = ACameraOutputTarget_create(d->captureWindow, &d->cameraCaptureOutputTarget);
+	if (camera_status != ACAMERA_OK) {
+		ms_error("[Camera2 Capture] Couldn't create output target, error is %s", android_camera2_status_to_string(camera_status));
+		return false;
+	}
+
+	camera_status = ACaptureRequest_addTarget(d->capturePreviewRequest, d->cameraCaptureOutputTarget);
+	if (camera_status != ACAMERA_OK) {
+		ms_error("[Camera2 Capture] Couldn't add output target to capture request, error is %s", android_camera2_status_to_string(camera_status));
+		return false;
+	}
+
+	camera_status = ACaptureSessionOutput_create(d->captureWindow, &d->sessionCaptureOutput);
+	if (camera_status != ACAMERA_OK) {
+		ms_error("[Camera2 Capture] Couldn't create capture session output, error is %s", android_camera2_status_to_string(camera_status));
+		return false;
+	}
+
+	camera_status = ACaptureSessionOutputContainer_add(d->captureSessionOutputContainer, d->sessionCaptureOutput);
+	if (camera_status != ACAMERA_OK) {
+		ms_error("[Camera2 Capture] Couldn't add capture session output to container, error is %s", android_camera2_status_to_string(camera_status));
+		return false;
+	}
+
+	if (d->concurrentCapture) {
+		// NDK API 28, looked up at runtime as we build against API 24
+		static ACameraDevice_isSessionConfigurationSupported_func isSessionConfigurationSupported =
+			(ACameraDevice_isSessionConfigurationSupported_func)dlsym(RTLD_DEFAULT, "ACameraDevice_isSessionConfigurationSupported");
+		if (isSessionConfigurationSupported) {
+			camera_status = isSessionConfigurationSupported(d->cameraDevice, d->captureSessionOutputContainer);
+			if (camera_status == ACAMERA_ERROR_STREAM_CONFIGURE_FAIL) {
+				ms_error("[Camera2 Capture] Session configuration %ix%i isn't supported while other cameras are capturing", d->captureSize.width, d->captureSize.height);
+				return false;
+			}
+		}
+	}
+
+	android_camera2_trace_begin(AndroidCamera2TraceSessionCreate);
+	camera_status = ACameraDevice_createCaptureSession(d->cameraDevice, d->captureSessionOutputContainer, &d->captureSessionStateCallbacks, &d->captureSession);
+	android_camera2_trace_end(AndroidCamera2TraceSessionCreate);
+	if (camera_status != ACAMERA_OK) {
+		ms_error("[Camera2 Capture] Couldn't create capture session, error is %s", android_camera2_status_to_string(camera_status));
+		return false;
+	}
+	d->sessionCreationDuration = android_camera2_capture_get_time_ms() - time;
+
+	return true;
+}
+
+static void android_camera2_capture_start(AndroidCamera2Context *d) {
+	ms_message("[Camera2 Capture] Starting capture");
+	camera_status_t camera_status = ACAMERA_OK;
+
+	if (d->capturing) {
+		ms_warning("[Camera2 Capture] Capture was already started, ignoring...");
+		return;
+	}
+	if (!d->configured) {
+		ms_warning("[Camera2 Capture] Filter configuration not finished, ignoring...");
+		return;
+	}
+
+	if (d->replayReader) {
+		android_camera2_capture_reset_stats(d);
+		android_camera2_capture_start_replay(d);
+		d->capturing = true;
+		d->captureStarts++;
+		ms_message("[Camera2 Capture] Capture started from raw dump");
+		return;
+	}
+
+	if (d->captureSession) {
+		ms_message("[Camera2 Capture] Using pre-warmed capture session");
+		d->previewCreationDuration = 0;
+		d->cameraOpenDuration = 0;
+		d->sessionCreationDuration = 0;
+	} else if (!android_camera2_capture_create_session(d)) {
+		android_camera2_capture_release_session(d);
+		android_camera2_capture_release_image_reader(d);
+		if (d->concurrentCapture && d->concurrentSizeLimit.width > 320) {
+			d->concurrentSizeLimit.width /= 2;
+			d->concurrentSizeLimit.height /= 2;
+			ms_warning("[Camera2 Capture] Concurrent capture failed, size will be limited to %ix%i from the next configuration",
+				d->concurrentSizeLimit.width, d->concurrentSizeLimit.height);
+		}
+		// Once the limit can't be lowered anymore, keep retrying slowly until the other cameras stop
+		d->startRetryDelay = d->startRetryDelay == 0 ? ANDROID_CAMERA2_START_RETRY_MIN_DELAY : d->startRetryDelay * 2;
+		if (d->startRetryDelay > ANDROID_CAMERA2_START_RETRY_MAX_DELAY) d->startRetryDelay = ANDROID_CAMERA2_START_RETRY_MAX_DELAY;
+		d->startRetryTime = android_camera2_capture_get_time_ms() + d->startRetryDelay;
+		ms_warning("[Camera2 Capture] Couldn't start capture, retrying in %d ms", d->startRetryDelay);
+		return;
+	}
+	d->startRetryDelay = 0;
+	d->startRetryTime = 0;
+
+	android_camera2_capture_reset_stats(d);
+	android_camera2_capture_start_worker(d);
+	d->captureCallbacks.context = d;
+	d->captureCallbacks.onCaptureStarted = android_camera2_capture_on_capture_started;
+	d->captureCallbacks.onCaptureCompleted = android_camera2_capture_on_capture_completed;
+	d->captureCallbacks.onCaptureFailed = android_camera2_capture_on_capture_failed;
+	d->captureCallbacks.onCaptureBufferLost = android_camera2_capture_on_capture_buffer_lost;
+
+	if (d->suspended) {
+		ms_message("[Camera2 Capture] Capture is suspended, session is ready but sensor won't be started until resumed");
+	} else {
+		camera_status = android_camera2_capture_set_repeating_request(d);
+		if (camera_status != ACAMERA_OK) {
+			// Not capturing so stop() won't be called, the session is kept and the next process() retries
+			android_camera2_capture_stop_worker(d);
+			return;
+		}
+	}
+
+	d->capturing = true;
+	d->prewarmed = false;
+	d->captureStarts++;
+	ms_message("[Camera2 Capture] Capture started");
+}
+
+/*
+ * Session, image reader and preview depend on the size and the window, the device doesn't: a pre-warmed device is kept
+ * open when keepPrewarmedDevice is set so reconfiguring before the capture starts doesn't lose the pre-warm.
+ */
+static void android_camera2_capture_stop_internal(AndroidCamera2Context *d, bool keepPrewarmedDevice) {
+	ms_message("[Camera2 Capture] Stopping capture");
+	AndroidCamera2TraceScope trace(AndroidCamera2TraceStop);
+
+	ms_filter_lock(d->filter);
+	d->configured = false;
+	ms_filter_unlock(d->filter);
+
+	if (!d->capturing && !d->prewarmed) {
+		ms_warning("[Camera2 Capture] Capture was already stopped, ignoring...");
+		ms_filter_unlock(d->filter);
+		return;
+	}
+	bool keepDevice = keepPrewarmedDevice && d->prewarmed && !d->capturing && d->cameraDevice;
+	d->capturing = false;
+	d->prewarmed = keepDevice;
+
+	MSAndroidCamera2CaptureStats stats;
+	android_camera2_capture_get_stats_internal(d, &stats);
+	ms_message("[Camera2 Capture] %lld frames captured, %lld dropped by HAL, %lld skipped by sensor, %lld dropped in image reader, %lld dropped before being sent, frame duration %.2fms (requested %.2fms)",
+		(long long)stats.capturedFrames, (long long)stats.halDroppedFrames, (long long)stats.sensorSkippedFrames, (long long)stats.readerDroppedFrames,
+		(long long)stats.pluginDroppedFrames, stats.actualFrameDuration, stats.requestedFrameDuration);
+	if (d->pacing.enabled) {
+		ms_message("[Camera2 Capture] Frame pacing added %.2fms of latency on average", stats.pacingLatency);
+	} else {
+		ms_message("[Camera2 Capture] Frames were sent %.2fms on average (max %.2fms) after their capture%s, %s mode", stats.emitLatency, stats.maxEmitLatency,
+			d->sensorTimestampRealtime && !d->replayReader ? "" : " (estimated)", d->pushTicker ? "push" : "polling");
+	}
+	if (stats.convertedFrames > 0) {
+		ms_message("[Camera2 Capture] %lld frames converted %s, %.3fms CPU per frame for conversion, %.3fms CPU per frame in image reader callback",
+			(long long)stats.convertedFrames, d->workerRunning ? "on worker thread" : "in image reader callback",
+			stats.conversionCpuTime / stats.convertedFrames, stats.callbackCpuTime / stats.convertedFrames);
+	}
+	if (d->highFrameRate.activeFps > 0) {
+		ms_message("[Camera2 Capture] High frame rate was %d fps, %.1f fps delivered over the last check", d->highFrameRate.activeFps, d->highFrameRate.deliveredFps);
+	}
+
+	android_camera2_capture_stop_replay(d);
+	android_camera2_capture_release_session(d);
+	if (keepDevice) {
+		ms_message("[Camera2 Capture] Keeping pre-warmed camera %s open", d->device->camId);
+	} else {
+		android_camera2_capture_close_camera(d);
+	}
+	android_camera2_capture_release_image_reader(d);
+
+	android_camera2_capture_destroy_preview(d);
+
+	ms_message("[Camera2 Capture] Capture stopped");
+}
+
+static void android_camera2_capture_stop(AndroidCamera2Context *d) {
+	android_camera2_capture_stop_internal(d, false);
+}
+
+/* Camera device and capture session are kept, only the repeating request is stopped so the sensor and the ISP idle */
+static void android_camera2_capture_suspend(AndroidCamera2Context *d) {
+	if (d->suspended) return;
+	d->suspended = true;
+	d->lastSuspendedFrameTime = 0;
+
+	if (d->capturing && d->captureSession) {
+		camera_status_t camera_status = ACameraCaptureSession_stopRepeating(d->captureSession);
+		if (camera_status != ACAMERA_OK) {
+			ms_error("[Camera2 Capture] Couldn't stop repeating request to suspend capture, error is %s", android_camera2_status_to_string(camera_status));
+		}
+	}
+	if (d->replayRunning) {
+		// The thread doesn't take the filter lock, wait for the frame it may be converting so it's flushed below
+		d->replayPaused = true;
+		while (!d->replayIdle) ms_usleep(1000);
+	}
+	android_camera2_capture_flush_frames(d);
+	ms_message("[Camera2 Capture] Capture suspended");
+}
+
+static void android_camera2_capture_resume(AndroidCamera2Context *d) {
+	if (!d->suspended) return;
+	d->suspended = false;
+
+	if (d->capturing && d->captureSession) {
+		// Sensor timestamps have a hole while suspended that mustn't be counted as skipped frames
+		d->lastSensorTimestamp = 0;
+		d->resumeRequestTime = android_camera2_capture_get_time_ms();
+		d->highFrameRateCheckTime = 0;
+		d->highFrameRateSettling = true;
+		android_camera2_capture_set_repeating_request(d);
+	}
+	d->replayPaused = false;
+	ms_message("[Camera2 Capture] Capture resumed");
+}
+
+/* ************************************************************************* */
+
+static void android_camera2_capture_init(MSFilter *f) {
+	ms_message("[Camera2 Capture] Filter init");
+	AndroidCamera2Context* d = new AndroidCamera2Context(f);
+	android_camera2_capture_reset_stats(d);
+	f->data = d;
+}
+
+static void android_camera2_capture_preprocess(MSFilter *f) {
+	ms_message("[Camera2 Capture] Filter preprocess");
+	AndroidCamera2Context *d = (AndroidCamera2Context *)f->data;
+
+	ms_filter_lock(f);
+	ms_video_init_framerate_controller(&d->fpsControl, android_camera2_capture_get_target_fps(d));
+	ms_video_init_average_fps(&d->averageFps, d->fps_context);
+	ms_filter_unlock(f);
+
+	android_camera2_capture_flush_frames(d);
+}
+
+static MSVideoSize android_camera2_capture_get_output_size(AndroidCamera2Context *d) {
+	int orientation = android_camera2_capture_get_orientation(d);
+	if (orientation % 180 == 0) {
+		d->previewSize.width = d->captureSize.width;
+		d->previewSize.height = d->captureSize.height;
+	} else {
+		d->previewSize.width = d->captureSize.height;
+		d->previewSize.height = d->captureSize.width;
+	}
+	MSVideoSize outputSize = d->previewSize;
+	if (d->outputFormat == MS_ANDROID_CAMERA2_PIX_FMT_GRAY8) {
+		outputSize.width /= d->lumaDecimation;
+		outputSize.height /= d->lumaDecimation;
+	}
+	return outputSize;
+}
+
+static mblk_t *android_camera2_capture_get_black_frame(AndroidCamera2Context *d) {
+	MSVideoSize size = android_camera2_capture_get_output_size(d);
+	if (d->blackFrame && ms_video_size_equal(size, d->blackFrameSize)) {
+		return d->blackFrame;
+	}
+
+	if (d->blackFrame) freemsg(d->blackFrame);
+	d->blackFrameSize = size;
+	if (d->outputFormat == MS_ANDROID_CAMERA2_PIX_FMT_GRAY8) {
+		d->blackFrame = allocb(size.width * size.height, 0);
+		memset(d->blackFrame->b_wptr, 16, size.width * size.height);
+		d->blackFrame->b_wptr += size.width * size.height;
+	} else {
+		MSPicture pict;
+		d->blackFrame = ms_yuv_buf_alloc(&pict, size.width, size.height);
+		memset(pict.planes[0], 16, pict.strides[0] * pict.h);
+		memset(pict.planes[1], 128, pict.strides[1] * pict.h / 2);
+		memset(pict.planes[2], 128, pict.strides[2] * pict.h / 2);
+	}
+	return d->blackFrame;
+}
+
+/* Keeps the downstream graph fed at a very low rate while the sensor is stopped */
+static void android_camera2_capture_send_suspended_frame(AndroidCamera2Context *d) {
+	MSFilter *f = d->filter;
+	if (d->suspend.output == MSAndroidCamera2CaptureSuspendOutputNone) return;
+
+	uint64_t interval = (uint64_t)(1000 / d->suspend.fps);
+	if (d->lastSuspendedFrameTime != 0 && f->ticker->time - d->lastSuspendedFrameTime < interval) return;
+	d->lastSuspendedFrameTime = f->ticker->time;
+
+	mblk_t *m = nullptr;
+	if (d->suspend.output == MSAndroidCamera2CaptureSuspendOutputLastFrame && d->lastFrame) {
+		m = dupmsg(d->lastFrame);
+	} else {
+		m = dupmsg(android_camera2_capture_get_black_frame(d));
+	}
+	mblk_set_timestamp_info(m, f->ticker->time * 90);
+	ms_queue_put(f->outputs[0], m);
+}
+
+/*
+ * Measures the rate of the completed capture results over a check window and programs the next lower range when the
+ * current one isn't delivered. Returns the new rate in fps if it fell back, or the current one the first time the lowest
+ * range isn't delivered, 0 otherwise.
+ */
+static int android_camera2_capture_check_high_frame_rate(AndroidCamera2Context *d, uint64_t time) {
+	int64_t capturedFrames = d->capturedFrames;
+	// Window only starts once the sensor is streaming
+	if (d->highFrameRateCheckTime == 0 || d->firstHalFrameTime == 0 || d->resumeRequestTime != 0) {
+		d->highFrameRateCheckTime = time;
+		d->highFrameRateCheckFrames = capturedFrames;
+		return 0;
+	}
+
+	uint64_t elapsed = time - d->highFrameRateCheckTime;
+	if (elapsed < ANDROID_CAMERA2_HIGH_FRAME_RATE_CHECK_INTERVAL) return 0;
+	float deliveredFps = (capturedFrames - d->highFrameRateCheckFrames) * 1000.f / elapsed;
+	d->highFrameRate.deliveredFps = deliveredFps;
+	d->highFrameRateCheckTime = time;
+	d->highFrameRateCheckFrames = capturedFrames;
+	if (d->highFrameRateSettling) {
+		d->highFrameRateSettling = false;
+		return 0;
+	}
+
+	int activeFps = d->highFrameRate.activeFps;
+	if (deliveredFps >= activeFps * 0.9f) {
+		d->highFrameRateMissedChecks = 0;
+		if (!d->highFrameRateConfirmed) {
+			d->highFrameRateConfirmed = true;
+			ms_message("[Camera2 Capture] High frame rate of %d fps confirmed, %.1f fps delivered", activeFps, deliveredFps);
+		}
+		return 0;
+	}
+
+	d->highFrameRateMissedChecks++;
+	ms_warning("[Camera2 Capture] Only %.1f fps delivered out of the %d fps programmed", deliveredFps, activeFps);
+	if (d->highFrameRateMissedChecks < ANDROID_CAMERA2_HIGH_FRAME_RATE_MAX_MISSED_CHECKS) return 0;
+	if (d->highFrameRateRangeIndex + 1 >= d->highFrameRateRangeCount) {
+		ms_warning("[Camera2 Capture] No lower fps range to fall back to, keeping %d fps and stopping the checks", activeFps);
+		d->highFrameRateExhausted = true;
+		return activeFps;
+	}
+
+	// Kept for the next sessions too, until the high frame rate or the capture size is set again
+	d->highFrameRateRangeIndex++;
+	android_camera2_capture_apply_frame_rate(d);
+	android_camera2_capture_set_repeating_request(d);
+	ms_warning("[Camera2 Capture] Falling back from %d to %d fps", activeFps, d->highFrameRate.activeFps);
+	return d->highFrameRate.activeFps;
+}
+
+static void android_camera2_capture_process(MSFilter *f) {
+	AndroidCamera2Context *d = (AndroidCamera2Context *)f->data;
+	ms_filter_lock(f);
+	android_camera2_capture_update_push_mode(d, f->ticker);
+
+	if (!d->capturing && d->configured) {
+		uint64_t time = android_camera2_capture_get_time_ms();
+		if (time >= d->startRetryTime) {
+			d->firstHalFrameTime = 0;
+			d->firstFrameTime = 0;
+			d->startRequestTime = time;
+			android_camera2_capture_start(d);
+		}
+	}
+
+	bool sceneChanged = false;
+	bool hasFaces = false;
+	MSAndroidCamera2CaptureFaces faces;
+	android_camera2_trace_begin(AndroidCamera2TraceProcessEmit);
+	ms_mutex_lock(&d->mutex);
+	if (d->pacing.enabled) {
+		uint64_t emitTime = 0;
+		mblk_t *m = android_camera2_capture_get_paced_frame(d, f->ticker->time, f->ticker->interval, &emitTime, &faces, &hasFaces);
+		if (m) {
+			ms_video_update_average_fps(&d->averageFps, f->ticker->time);
+			mblk_set_timestamp_info(m, emitTime * 90);
+			faces.timestamp = emitTime * 90;
+			sceneChanged = d->sceneDetection.enabled && mblk_get_independent_flag(m);
+			android_camera2_capture_set_last_frame(d, m);
+			ms_queue_put(f->outputs[0], m);
+		}
+	} else if (d->frame) {
+		ms_video_update_average_fps(&d->averageFps, f->ticker->time);
+		mblk_set_timestamp_info(d->frame, f->ticker->time * 90);
+		sceneChanged = d->sceneDetection.enabled && mblk_get_independent_flag(d->frame);
+		hasFaces = d->frameHasFaces;
+		faces = d->frameFaces;
+		faces.timestamp = f->ticker->time * 90;
+
+		int64_t latency = (int64_t)android_camera2_capture_get_time_us() - ((int64_t)d->frameSensorTime + d->sensorClockOffset);
+		int64_t average = d->emitLatency;
+		d->emitLatency = average == 0 ? latency : average + (latency - average) / 16;
+		if (latency > d->maxEmitLatency) d->maxEmitLatency = latency;
+		android_camera2_capture_set_last_frame(d, d->frame);
+		ms_queue_put(f->outputs[0], d->frame);
+		d->frame = nullptr;
+	}
+	ms_mutex_unlock(&d->mutex);
+	android_camera2_trace_end(AndroidCamera2TraceProcessEmit);
+
+	if (d->suspended && d->capturing) {
+		android_camera2_capture_send_suspended_frame(d);
+	}
+
+	int fallbackFps = 0;
+	if (d->highFrameRate.activeFps > 0 && !d->highFrameRateExhausted && d->capturing && !d->suspended && !d->replayReader) {
+		fallbackFps = android_camera2_capture_check_high_frame_rate(d, f->ticker->time);
+	}
+
+	if (sceneChanged) {
+		ms_filter_notify_no_arg(f, MS_ANDROID_CAMERA2_CAPTURE_SCENE_CHANGED);
+	}
+	if (hasFaces) {
+		ms_filter_notify(f, MS_ANDROID_CAMERA2_CAPTURE_FACES_DETECTED, &faces);
+	}
+	if (fallbackFps > 0) {
+		ms_filter_notify(f, MS_ANDROID_CAMERA2_CAPTURE_FRAME_RATE_FALLBACK, &fallbackFps);
+	}
+
+	ms_filter_unlock(f);
+}
+
+static void android_camera2_capture_postprocess(MSFilter *f) {
+	ms_message("[Camera2 Capture] Filter postprocess");
+	AndroidCamera2Context *d = (AndroidCamera2Context *)f->data;
+
+	if (d->capturing) {
+		android_camera2_capture_stop(d);
+	}
+
+	ms_filter_lock(f);
+	android_camera2_capture_remove_push_mode(d);
+	ms_filter_unlock(f);
+
+	android_camera2_capture_flush_frames(d);
+	android_camera2_capture_set_last_frame(d, nullptr);
+}
 
 static void android_camera2_capture_uninit(MSFilter *f) {
 	ms_message("[Camera2 Capture] Filter uninit");
 	ms_filter_lock(f);
 	AndroidCamera2Context *d = (AndroidCamera2Context *)f->data;
+	// Threads are normally stopped by stop(), make sure none still uses the context
+	android_camera2_capture_stop_worker(d);
+	android_camera2_capture_stop_replay(d);
 	delete d;
 	ms_filter_unlock(f);
 }
 
-/* ************************************************************************* */
-
-static int android_camera2_capture_set_fps(MSFilter *f, void *arg) {
+/* ************************************************************************* */
+
+static int android_camera2_capture_set_fps(MSFilter *f, void *arg) {
+	AndroidCamera2Context *d = (AndroidCamera2Context *)f->data;
+	d->fps = *((float*)arg);
+	snprintf(d->fps_context, sizeof(d->fps_context), "Captured mean fps=%%f, expected=%f", d->fps);
+	ms_filter_lock(f);
+	ms_video_init_framerate_controller(&d->fpsControl, android_camera2_capture_get_target_fps(d));
+	ms_video_init_average_fps(&d->averageFps, d->fps_context);
+	ms_filter_unlock(f);
+	return 0;
+}
+
+static int android_camera2_capture_get_fps(MSFilter *f, void *arg) {
+	AndroidCamera2Context *d = (AndroidCamera2Context *)f->data;
+	*((float*)arg) = ms_average_fps_get(&d->averageFps);
+	return 0;
+}
+
+static int64_t android_camera2_capture_get_min_frame_duration(const ACameraMetadata_const_entry *durations, int32_t format, int32_t width, int32_t height) {
+	for (uint32_t i = 0; i + 3 < durations->count; i += 4) {
+		if (durations->data.i64[i] == format && durations->data.i64[i + 1] == width && durations->data.i64[i + 2] == height) {
+			return durations->data.i64[i + 3];
+		}
+	}
+	return -1;
+}
+
+/*
+ * Keeps the AE target fps ranges whose max is between minFps and fps, the one with the highest min for each max so
+ * the sensor rate stays constant, then picks the largest size not above the capture size that the sensor can deliver at
+ * the highest of these rates, going down the rates until one fits. Lower ranges are kept to fall back to.
+ */
+static void android_camera2_capture_choose_high_frame_rate(AndroidCamera2Context *d, const ACameraMetadata *cameraMetadata) {
+	d->highFrameRateRangeCount = 0;
+	d->highFrameRateRangeIndex = -1;
+	if (!d->highFrameRate.enabled || d->captureSize.width == 0 || d->captureSize.height == 0) return;
+
+	int targetFps = d->highFrameRate.fps > 0 ? d->highFrameRate.fps : 60;
+	int minFps = d->highFrameRate.minFps > 0 ? d->highFrameRate.minFps : 30;
+	ACameraMetadata_const_entry fpsRanges;
+	ACameraMetadata_const_entry durations;
+	ACameraMetadata_const_entry scaler;
+	if (ACameraMetadata_getConstEntry(cameraMetadata, ACAMERA_CONTROL_AE_AVAILABLE_TARGET_FPS_RANGES, &fpsRanges) != ACAMERA_OK
+		|| ACameraMetadata_getConstEntry(cameraMetadata, ACAMERA_SCALER_AVAILABLE_MIN_FRAME_DURATIONS, &durations) != ACAMERA_OK
+		|| ACameraMetadata_getConstEntry(cameraMetadata, ACAMERA_SCALER_AVAILABLE_STREAM_CONFIGURATIONS, &scaler) != ACAMERA_OK) {
+		ms_warning("[Camera2 Capture] Device doesn't list its fps ranges or min frame durations, high frame rate isn't available");
+		return;
+	}
+
+	int count = 0;
+	for (uint32_t i = 0; i + 1 < fpsRanges.count; i += 2) {
+		int32_t min = fpsRanges.data.i32[i];
+		int32_t max = fpsRanges.data.i32[i + 1];
+		if (max < minFps || max > targetFps) continue;
+
+		int j = 0;
+		while (j < count && d->highFrameRateRanges[j][1] > max) j++;
+		if (j < count && d->highFrameRateRanges[j][1] == max) {
+			if (min > d->highFrameRateRanges[j][0]) d->highFrameRateRanges[j][0] = min;
+			continue;
+		}
+		if (count == ANDROID_CAMERA2_HIGH_FRAME_RATE_MAX_RANGES) continue;
+		memmove(&d->highFrameRateRanges[j + 1], &d->highFrameRateRanges[j], (count - j) * sizeof(d->highFrameRateRanges[0]));
+		d->highFrameRateRanges[j][0] = min;
+		d->highFrameRateRanges[j][1] = max;
+		count++;
+	}
+	if (count == 0) {
+		ms_warning("[Camera2 Capture] No fps range between %d and %d fps, high frame rate isn't available", minFps, targetFps);
+		return;
+	}
+
+	double captureRatio = (double)d->captureSize.width / (double)d->captureSize.height;
+	for (int r = 0; r < count; r++) {
+		int64_t maxFrameDuration = 1000000000LL / d->highFrameRateRanges[r][1];
+		MSVideoSize bestSize;
+		bestSize.width = 0;
+		bestSize.height = 0;
+		for (uint32_t i = 0; i + 3 < scaler.count; i += 4) {
+			int32_t format = scaler.data.i32[i + 0];
+			int32_t width = scaler.data.i32[i + 1];
+			int32_t height = scaler.data.i32[i + 2];
+			int32_t input = scaler.data.i32[i + 3];
+			if (input || format != d->captureFormat) continue;
+			if (width > d->captureSize.width || height > d->captureSize.height) continue;
+
+			int64_t minFrameDuration = android_camera2_capture_get_min_frame_duration(&durations, format, width, height);
+			if (minFrameDuration < 0 || minFrameDuration > maxFrameDuration) continue;
+
+			// Same aspect ratio as the capture size first, then the largest area
+			bool sameRatio = fabs((double)width / (double)height - captureRatio) <= 0.01;
+			bool bestSameRatio = bestSize.width != 0 && fabs((double)bestSize.width / (double)bestSize.height - captureRatio) <= 0.01;
+			if (bestSize.width == 0 || (sameRatio && !bestSameRatio)
+				|| (sameRatio == bestSameRatio && width * height > bestSize.width * bestSize.height)) {
+				bestSize.width = width;
+				bestSize.height = height;
+			}
+		}
+		if (bestSize.width == 0) {
+			ms_message("[Camera2 Capture] No size up to %ix%i can be captured at %d fps", d->captureSize.width, d->captureSize.height, d->highFrameRateRanges[r][1]);
+			continue;
+		}
+
+		// Lower ranges have longer frame durations so the chosen size sustains them as well
+		memmove(&d->highFrameRateRanges[0], &d->highFrameRateRanges[r], (count - r) * sizeof(d->highFrameRateRanges[0]));
+		d->highFrameRateRangeCount = count - r;
+		d->highFrameRateRangeIndex = 0;
+		if (!ms_video_size_equal(bestSize, d->captureSize)) {
+			ms_warning("[Camera2 Capture] Lowering capture size from %ix%i to %ix%i for high frame rate", d->captureSize.width, d->captureSize.height,
+				bestSize.width, bestSize.height);
+			d->captureSize = bestSize;
+		}
+		ms_message("[Camera2 Capture] High frame rate will use fps range [%d-%d] at %ix%i, %d lower range(s) to fall back to",
+			d->highFrameRateRanges[0][0], d->highFrameRateRanges[0][1], bestSize.width, bestSize.height, d->highFrameRateRangeCount - 1);
+		return;
+	}
+	ms_warning("[Camera2 Capture] Sensor can't deliver any rate between %d and %d fps, high frame rate isn't available", minFps, targetFps);
+}
+
+static void android_camera2_capture_choose_best_configurations(AndroidCamera2Context *d) {
+	ms_message("[Camera2 Capture] Listing camera %s configurations", d->device->camId);
+
+	const ACameraMetadata *cameraMetadata = android_camera2_manager_get_characteristics(d->device->camId);
+	if (!cameraMetadata) {
+		return;
+	}
+
+	ACameraMetadata_const_entry supportedFpsRanges;
+	ACameraMetadata_getConstEntry(cameraMetadata, ACAMERA_CONTROL_AE_AVAILABLE_TARGET_FPS_RANGES, &supportedFpsRanges);
+	for (int i = 0; i < supportedFpsRanges.count; i += 2) {
+		int32_t min = supportedFpsRanges.data.i32[i];
+		int32_t max = supportedFpsRanges.data.i32[i + 1];
+		ms_message("[Camera2 Capture] Supported FPS range: [%d-%d]", min, max);
+	}
+
+	ACameraMetadata_const_entry modes;
+	d->availableNoiseReductionModes = 0;
+	if (ACameraMetadata_getConstEntry(cameraMetadata, ACAMERA_NOISE_REDUCTION_AVAILABLE_NOISE_REDUCTION_MODES, &modes) == ACAMERA_OK) {
+		for (uint32_t i = 0; i < modes.count; i++) d->availableNoiseReductionModes |= 1 << modes.data.u8[i];
+	}
+	d->availableEdgeModes = 0;
+	if (ACameraMetadata_getConstEntry(cameraMetadata, ACAMERA_EDGE_AVAILABLE_EDGE_MODES, &modes) == ACAMERA_OK) {
+		for (uint32_t i = 0; i < modes.count; i++) d->availableEdgeModes |= 1 << modes.data.u8[i];
+	}
+	d->availableVideoStabilizationModes = 0;
+	if (ACameraMetadata_getConstEntry(cameraMetadata, ACAMERA_CONTROL_AVAILABLE_VIDEO_STABILIZATION_MODES, &modes) == ACAMERA_OK) {
+		for (uint32_t i = 0; i < modes.count; i++) d->availableVideoStabilizationModes |= 1 << modes.data.u8[i];
+	}
+
+	ACameraMetadata_const_entry activeArraySize;
+	if (ACameraMetadata_getConstEntry(cameraMetadata, ACAMERA_SENSOR_INFO_ACTIVE_ARRAY_SIZE, &activeArraySize) == ACAMERA_OK) {
+		memcpy(d->activeArraySize, activeArraySize.data.i32, sizeof(d->activeArraySize));
+	}
+	ACameraMetadata_const_entry maxDigitalZoom;
+	if (ACameraMetadata_getConstEntry(cameraMetadata, ACAMERA_SCALER_AVAILABLE_MAX_DIGITAL_ZOOM, &maxDigitalZoom) == ACAMERA_OK) {
+		d->maxDigitalZoom = maxDigitalZoom.data.f[0];
+	}
+	ms_message("[Camera2 Capture] Active array is %dx%d at %d,%d, max digital zoom is %f",
+		d->activeArraySize[2], d->activeArraySize[3], d->activeArraySize[0], d->activeArraySize[1], d->maxDigitalZoom);
+
+	d->faceDetectionSupported = false;
+	ACameraMetadata_const_entry maxFaceCount;
+	if (ACameraMetadata_getConstEntry(cameraMetadata, ACAMERA_STATISTICS_INFO_AVAILABLE_FACE_DETECT_MODES, &modes) == ACAMERA_OK
+		&& ACameraMetadata_getConstEntry(cameraMetadata, ACAMERA_STATISTICS_INFO_MAX_FACE_COUNT, &maxFaceCount) == ACAMERA_OK
+		&& maxFaceCount.data.i32[0] > 0) {
+		for (uint32_t i = 0; i < modes.count; i++) {
+			if (modes.data.u8[i] == ACAMERA_STATISTICS_FACE_DETECT_MODE_SIMPLE) d->faceDetectionSupported = true;
+		}
+		ms_message("[Camera2 Capture] Face detection %s supported, up to %d faces", d->faceDetectionSupported ? "is" : "isn't", maxFaceCount.data.i32[0]);
+	}
+
+	ACameraMetadata_const_entry pipelineMaxDepth;
+	if (ACameraMetadata_getConstEntry(cameraMetadata, ACAMERA_REQUEST_PIPELINE_MAX_DEPTH, &pipelineMaxDepth) == ACAMERA_OK) {
+		d->pipelineMaxDepth = pipelineMaxDepth.data.u8[0];
+	}
+
+	ACameraMetadata_const_entry timestampSource;
+	d->sensorTimestampRealtime = ACameraMetadata_getConstEntry(cameraMetadata, ACAMERA_SENSOR_INFO_TIMESTAMP_SOURCE, &timestampSource) == ACAMERA_OK
+		&& timestampSource.data.u8[0] == ACAMERA_SENSOR_INFO_TIMESTAMP_SOURCE_REALTIME;
+	ms_message("[Camera2 Capture] Pipeline max depth is %d, noise reduction modes mask %x, edge modes mask %x, video stabilization modes mask %x",
+		d->pipelineMaxDepth, d->availableNoiseReductionModes, d->availableEdgeModes, d->availableVideoStabilizationModes);
+	
+	ACameraMetadata_const_entry scaler;
+	ACameraMetadata_getConstEntry(cameraMetadata, ACAMERA_SCALER_AVAILABLE_STREAM_CONFIGURATIONS, &scaler);
+	
+	MSVideoSize backupSize;
+	backupSize.width = 0;
+	backupSize.height = 0;
+	double askedRatio = d->captureSize.width * d->captureSize.height;
+	bool found = false;
+	
+	for (int i = 0; i < scaler.count; i += 4) {
+		int32_t input = scaler.data.i32[i + 3];
+		int32_t format = scaler.data.i32[i + 0];
+		if (input) continue;
+
+		if (format == d->captureFormat) {
+			int32_t width = scaler.data.i32[i + 1];
+			int32_t height = scaler.data.i32[i + 2];
+			double currentSizeRatio = width * height;
+			ms_message("[Camera2 Capture] Available size width %d, height %d for requested format %d", width, height, format);
+
+			if (width == d->captureSize.width && height == d->captureSize.height) {
+				found = true;
+			} else {
+				double backupRatio = backupSize.width * backupSize.height;
+				if (backupRatio == 0 || fabs(askedRatio - currentSizeRatio) < fabs(askedRatio - backupRatio)) {
+					// Current resolution is closer to the one we want than the one in backup, update backup
+					backupSize.width = width;
+					backupSize.height = height;
+				}
+			}
+		} else {
+			int32_t width = scaler.data.i32[i + 1];
+			int32_t height = scaler.data.i32[i + 2];
+			ms_debug("[Camera2 Capture] Available size width %d, height %d for format %d", width, height, format);
+		}
+	}
+
+	if (found) {
+		ms_message("[Camera2 Capture] Found exact match for our required size of %ix%i", d->captureSize.width, d->captureSize.height);
+	} else {
+		// Asked resolution not found
+		d->captureSize.width = backupSize.width;
+		d->captureSize.height = backupSize.height;
+		ms_warning("[Camera2 Capture] Couldn't find requested resolution, instead using %ix%i", backupSize.width, backupSize.height);
+	}
+
+	android_camera2_capture_choose_high_frame_rate(d, cameraMetadata);
+}
+
+static void android_camera2_capture_choose_preview_stream_size(AndroidCamera2Context *d) {
+	d->previewStreamSize = d->captureSize;
+	if (d->requestedPreviewStreamSize.width == 0 || d->requestedPreviewStreamSize.height == 0
+		|| d->captureSize.width == 0 || d->captureSize.height == 0) {
+		return;
+	}
+
+	const ACameraMetadata *cameraMetadata = android_camera2_manager_get_characteristics(d->device->camId);
+	if (!cameraMetadata) {
+		return;
+	}
+
+	ACameraMetadata_const_entry scaler;
+	ACameraMetadata_getConstEntry(cameraMetadata, ACAMERA_SCALER_AVAILABLE_STREAM_CONFIGURATIONS, &scaler);
+
+	// Keep the capture aspect ratio so the self-view shows the same field of view as what is sent,
+	// and never go above the requested size, the whole point is to save ISP bandwidth
+	double captureRatio = (double)d->captureSize.width / (double)d->captureSize.height;
+	double askedArea = d->requestedPreviewStreamSize.width * d->requestedPreviewStreamSize.height;
+	MSVideoSize bestSize;
+	bestSize.width = 0;
+	bestSize.height = 0;
+
+	for (int i = 0; i < scaler.count; i += 4) {
+		int32_t format = scaler.data.i32[i + 0];
+		int32_t width = scaler.data.i32[i + 1];
+		int32_t height = scaler.data.i32[i + 2];
+		int32_t input = scaler.data.i32[i + 3];
+		if (input || format != ANDROID_CAMERA2_PREVIEW_STREAM_FORMAT) continue;
+		if (width > d->captureSize.width || height > d->captureSize.height) continue;
+		if (fabs((double)width / (double)height - captureRatio) > 0.01) continue;
+
+		double currentArea = width * height;
+		double bestArea = bestSize.width * bestSize.height;
+		if (bestArea == 0 || fabs(askedArea - currentArea) < fabs(askedArea - bestArea)) {
+			bestSize.width = width;
+			bestSize.height = height;
+		}
+	}
+
+	if (bestSize.width != 0 && bestSize.height != 0) {
+		d->previewStreamSize = bestSize;
+		ms_message("[Camera2 Capture] Using preview stream size %ix%i for requested %ix%i (capture size is %ix%i)", bestSize.width, bestSize.height,
+			d->requestedPreviewStreamSize.width, d->requestedPreviewStreamSize.height, d->captureSize.width, d->captureSize.height);
+	} else {
+		ms_warning("[Camera2 Capture] No preview stream size matching capture aspect ratio found, using capture size %ix%i", d->captureSize.width, d->captureSize.height);
+	}
+}
+
+static void android_camera2_capture_create_surface_from_surface_texture(AndroidCamera2Context *d) {
+	JNIEnv *env = ms_get_jni_env();
+	jobject surface = nullptr;
+	jobject surfaceTexture = d->nativeWindowId;
+
+	jclass surfaceTextureClass = env->FindClass("android/graphics/SurfaceTexture");
+	if (!surfaceTextureClass) {
+		ms_error("[Camera2 Capture] Could not find android.graphics.SurfaceTexture class");
+		return;
+	}
+
+	jclass surfaceClass = env->FindClass("android/view/Surface");
+	if (!surfaceClass) {
+		ms_error("[Camera2 Capture] Could not find android.view.Surface class");
+		return;
+	}
+
+	jclass textureViewClass = env->FindClass("android/view/TextureView");
+	if (!textureViewClass) {
+		ms_error("[Camera2 Capture] Could not find android.view.TextureView class");
+		return;
+	}
+
+	if (env->IsInstanceOf(surfaceTexture, surfaceClass)) {
+		// The buffer size of a Surface is owned by its producer side (SurfaceView), preview stream size can't be applied
+		ms_message("[Camera2 Capture] NativePreviewWindowId %p is a Surface, using it directly", surfaceTexture);
+		d->surface = (jobject)env->NewGlobalRef(surfaceTexture);
+		return;
+	}
+
+	if (env->IsInstanceOf(surfaceTexture, textureViewClass)) {
+		ms_message("[Camera2 Capture] NativePreviewWindowId %p is a TextureView", surfaceTexture);
+
+		jmethodID getSurfaceTexture = env->GetMethodID(textureViewClass, "getSurfaceTexture", "()Landroid/graphics/SurfaceTexture;");
+		surfaceTexture = env->CallObjectMethod(d->nativeWindowId, getSurfaceTexture);
+		if (surfaceTexture == nullptr) {
+			ms_error("[Camera2 Capture] TextureView isn't available !");
+			return;
+		}
+		ms_message("[Camera2 Capture] Got SurfaceTexture %p from TextureView %p", surfaceTexture, d->nativeWindowId);
+	}
+
+	if (surfaceTexture != nullptr) {
+		if (d->previewStreamSize.width != 0 && d->previewStreamSize.height != 0) {
+			jmethodID setDefaultBufferSize = env->GetMethodID(surfaceTextureClass, "setDefaultBufferSize", "(II)V");
+			env->CallVoidMethod(surfaceTexture, setDefaultBufferSize, d->previewStreamSize.width, d->previewStreamSize.height);
+			ms_message("[Camera2 Capture] Set default buffer size for SurfaceTexture %p to %ix%i", surfaceTexture, d->previewStreamSize.width, d->previewStreamSize.height);
+		} else {
+			ms_warning("[Camera2 Capture] SurfaceTexture buffer size not available yet, aborting for now, will come back later");
+			d->surface = nullptr;
+			return;
+		}
+	}
+
+	jmethodID ctor = env->GetMethodID(surfaceClass, "<init>", "(Landroid/graphics/SurfaceTexture;)V");
+	surface = env->NewObject(surfaceClass, ctor, surfaceTexture);
+	if (!surface) {
+		ms_error("[Camera2 Capture] Could not instanciate android.view.Surface object");
+		return;
+	}
+	d->surface = (jobject)env->NewGlobalRef(surface);
+	ms_message("[Camera2 Capture] Got Surface %p from SurfaceTexture %p",  d->surface, surfaceTexture);
+}
+
+static int android_camera2_capture_set_surface_texture(MSFilter *f, void *arg) {
+	AndroidCamera2Context *d = (AndroidCamera2Context *)f->data;
+	unsigned long id = *(unsigned long *)arg;
+	jobject nativeWindowId = (jobject)id;
+	JNIEnv *env = ms_get_jni_env();
+
+	ms_filter_lock(f);
+	jobject currentWindowId = d->nativeWindowId;
+	ms_filter_unlock(f);
+
+	ms_message("[Camera2 Capture] New native window ptr is %p, current one is %p", nativeWindowId, currentWindowId);
+	if (id == 0) {
+		if (currentWindowId) {
+			android_camera2_capture_stop(d);
+			env->DeleteGlobalRef(currentWindowId);
+			d->nativeWindowId = nullptr;
+		}
+	} else if (!env->IsSameObject(currentWindowId, nativeWindowId)) {
+		if (currentWindowId) {
+			android_camera2_capture_stop_internal(d, true);
+			env->DeleteGlobalRef(currentWindowId);
+		}
+		
+		d->nativeWindowId = env->NewGlobalRef(nativeWindowId);
+		android_camera2_capture_create_surface_from_surface_texture(d);
+		
+		ms_filter_lock(f);
+		android_camera2_check_configuration_ok(d);
+		ms_filter_unlock(f);
+
+		if (d->previewSize.width != 0 && d->previewSize.height != 0) {
+			ms_filter_notify(f, MS_CAMERA_PREVIEW_SIZE_CHANGED, &d->previewSize);
+		}
+	} else {
+		ms_message("[Camera2 Capture] New native window is the same as the current one, skipping...");
+	}
+
+	return 0; 
+}
+
+/*
+ * NDK doesn't expose the concurrent camera ids nor the mandatory concurrent stream combinations, so rely on the guarantee
+ * given by Android for concurrent streaming (up to 720p per stream), lowered each time the device still refuses the session.
+ * Applied when configuring only, the session creation uses the size chosen here: cameras started or stopped since, or a
+ * limit lowered by a failed start, are taken into account at the next configuration.
+ */
+static void android_camera2_capture_limit_capture_size(AndroidCamera2Context *d) {
+	d->concurrentSizeLimited = false;
+	if (android_camera2_manager_count_other_captures(d) == 0) {
+		// Lowered while other cameras were capturing, they are gone now
+		d->concurrentSizeLimit.width = 1280;
+		d->concurrentSizeLimit.height = 720;
+		return;
+	}
+
+	int limitArea = d->concurrentSizeLimit.width * d->concurrentSizeLimit.height;
+	if (d->captureSize.width * d->captureSize.height <= limitArea) {
+		return;
+	}
+
+	ms_warning("[Camera2 Capture] Limiting capture size %ix%i to %ix%i for concurrent capture", d->captureSize.width, d->captureSize.height,
+		d->concurrentSizeLimit.width, d->concurrentSizeLimit.height);
+	MSVideoSize limit = d->concurrentSizeLimit;
+	while (true) {
+		d->captureSize = limit;
+		android_camera2_capture_choose_best_configurations(d);
+		if (d->captureSize.width * d->captureSize.height <= limitArea || limit.width <= 160) break;
+		limit.width /= 2;
+		limit.height /= 2;
+	}
+	d->concurrentSizeLimited = true;
+}
+
+/* Chooses the capture, preview stream and output sizes from the requested size, with the capture stopped */
+static void android_camera2_capture_choose_capture_size(AndroidCamera2Context *d, MSVideoSize requestedSize) {
+	d->captureSize = requestedSize;
+	android_camera2_capture_choose_best_configurations(d);
+	android_camera2_capture_limit_capture_size(d);
+	android_camera2_capture_choose_preview_stream_size(d);
+
+	int orientation = android_camera2_capture_get_orientation(d);
+	if (orientation % 180 == 0) {
+		d->previewSize.width = d->captureSize.width;
+		d->previewSize.height = d->captureSize.height;
+	} else {
+		d->previewSize.width = d->captureSize.height;
+		d->previewSize.height = d->captureSize.width;
+	}
+}
+
+/* Stops the capture and chooses the configurations again from the requested size, process() starts it with them */
+static void android_camera2_capture_change_capture_size(AndroidCamera2Context *d, MSVideoSize requestedSize) {
+	MSFilter *f = d->filter;
+	MSVideoSize oldSize;
+	oldSize.width = d->captureSize.width;
+	oldSize.height = d->captureSize.height;
+
+	// Stopping removes this filter from the active captures, the limit only depends on the other ones
+	android_camera2_capture_stop_internal(d, true);
+	android_camera2_capture_choose_capture_size(d, requestedSize);
+
+	if (d->previewSize.width != 0 && d->previewSize.height != 0) {
+		ms_filter_notify(f, MS_CAMERA_PREVIEW_SIZE_CHANGED, &d->previewSize);
+	}
+
+	ms_message("[Camera2 Capture] Previous preview size was %i/%i, new size is %i/%i", 
+		oldSize.width, oldSize.height, d->previewSize.width, d->previewSize.height);
+
+	if (d->surface == nullptr && d->nativeWindowId != 0) {
+		ms_warning("[Camera2 Capture] Video size has changed after video window id has been set, have to recreate Surface object...");
+		android_camera2_capture_create_surface_from_surface_texture(d);
+	}
+
+	ms_filter_lock(f);
+	android_camera2_check_configuration_ok(d);
+	ms_filter_unlock(f);
+}
+
+static int android_camera2_capture_set_vsize(MSFilter *f, void* arg) {
+	AndroidCamera2Context *d = (AndroidCamera2Context *)f->data;
+
+	MSVideoSize requestedSize = *(MSVideoSize*)arg;
+	if (d->captureSize.width == requestedSize.width && d->captureSize.height == requestedSize.height) {
+		return -1;
+	}
+	if (d->replayReader) {
+		ms_warning("[Camera2 Capture] Replaying a raw dump, video size is the one of the dump");
+		return -1;
+	}
+	
+	d->requestedCaptureSize = requestedSize;
+	android_camera2_capture_change_capture_size(d, requestedSize);
+	return 0;
+}
+
+static int android_camera2_capture_get_vsize(MSFilter *f, void* arg) {
+	AndroidCamera2Context *d = (AndroidCamera2Context *)f->data;
+
+	ms_filter_lock(f);
+	MSVideoSize outputSize = android_camera2_capture_get_output_size(d);
+	ms_filter_unlock(f);
+
+	*(MSVideoSize*)arg = outputSize;
+	ms_message("[Camera2 Capture] Getting preview size: %ix%i", d->previewSize.width, d->previewSize.height);
+
+	return 0;
+}
+
+/* Tears down the session and surface, next process() will start again with the new configuration */
+static void android_camera2_capture_reconfigure(AndroidCamera2Context *d, bool keepPrewarmedDevice) {
+	android_camera2_capture_stop_internal(d, keepPrewarmedDevice);
+	// New configuration may work, don't wait for the previous one's retry delay
+	d->startRetryDelay = 0;
+	d->startRetryTime = 0;
+	if (d->device && !d->replayReader && d->requestedCaptureSize.width != 0 && d->requestedCaptureSize.height != 0) {
+		// Other cameras may have started or stopped since the capture size was chosen
+		MSVideoSize oldSize = d->captureSize;
+		android_camera2_capture_choose_capture_size(d, d->requestedCaptureSize);
+		if (oldSize.width != d->captureSize.width || oldSize.height != d->captureSize.height) {
+			ms_filter_notify(d->filter, MS_CAMERA_PREVIEW_SIZE_CHANGED, &d->previewSize);
+		}
+	}
+	android_camera2_capture_destroy_preview(d);
+	if (d->surface == nullptr && d->nativeWindowId != 0) {
+		android_camera2_capture_create_surface_from_surface_texture(d);
+	}
+
+	ms_filter_lock(d->filter);
+	android_camera2_check_configuration_ok(d);
+	ms_filter_unlock(d->filter);
+}
+
+static int android_camera2_capture_set_preview_stream_size(MSFilter *f, void* arg) {
+	AndroidCamera2Context *d = (AndroidCamera2Context *)f->data;
+
+	MSVideoSize requestedSize = *(MSVideoSize*)arg;
+	if (d->requestedPreviewStreamSize.width == requestedSize.width && d->requestedPreviewStreamSize.height == requestedSize.height) {
+		return -1;
+	}
+	d->requestedPreviewStreamSize = requestedSize;
+	ms_message("[Camera2 Capture] Requested preview stream size is %ix%i", requestedSize.width, requestedSize.height);
+
+	if (d->captureSize.width == 0 || d->captureSize.height == 0) {
+		// Will be applied when video size is set
+		return 0;
+	}
+
+	MSVideoSize oldSize = d->previewStreamSize;
+	android_camera2_capture_choose_preview_stream_size(d);
+	if (oldSize.width == d->previewStreamSize.width && oldSize.height == d->previewStreamSize.height) {
+		return 0;
+	}
+
+	// SurfaceTexture default buffer size can only be changed before the camera connects to it
+	android_camera2_capture_reconfigure(d, true);
+	return 0;
+}
+
+static int android_camera2_capture_get_preview_stream_size(MSFilter *f, void* arg) {
+	AndroidCamera2Context *d = (AndroidCamera2Context *)f->data;
+	ms_filter_lock(f);
+	*(MSVideoSize*)arg = d->previewStreamSize;
+	ms_filter_unlock(f);
+	return 0;
+}
+
+static int android_camera2_capture_set_profile(MSFilter *f, void* arg) {
+	AndroidCamera2Context *d = (AndroidCamera2Context *)f->data;
+	MSAndroidCamera2CaptureProfile profile = (MSAndroidCamera2CaptureProfile)*(int*)arg;
+	if (profile < MSAndroidCamera2CaptureProfileLowLatency || profile > MSAndroidCamera2CaptureProfileDefault) {
+		ms_error("[Camera2 Capture] Invalid capture profile %d", (int)profile);
+		return -1;
+	}
+	if (profile == d->profile) {
+		return 0;
+	}
+
+	ms_message("[Camera2 Capture] Capture profile changed from %s to %s", android_camera2_capture_profile_to_string(d->profile), android_camera2_capture_profile_to_string(profile));
+	d->profile = profile;
+
+	// Request template can't be changed on an existing request
+	if (d->capturing) {
+		android_camera2_capture_reconfigure(d, true);
+	}
+	return 0;
+}
+
+static int android_camera2_capture_get_profile(MSFilter *f, void* arg) {
+	AndroidCamera2Context *d = (AndroidCamera2Context *)f->data;
+	*(int*)arg = (int)d->profile;
+	return 0;
+}
+
+static int android_camera2_capture_get_pipeline_max_depth(MSFilter *f, void* arg) {
+	AndroidCamera2Context *d = (AndroidCamera2Context *)f->data;
+	*(int*)arg = d->pipelineMaxDepth;
+	return 0;
+}
+
+static int android_camera2_capture_get_stats(MSFilter *f, void* arg) {
+	AndroidCamera2Context *d = (AndroidCamera2Context *)f->data;
+	android_camera2_capture_get_stats_internal(d, (MSAndroidCamera2CaptureStats *)arg);
+	return 0;
+}
+
+static int android_camera2_capture_set_zoom(MSFilter *f, void* arg) {
+	AndroidCamera2Context *d = (AndroidCamera2Context *)f->data;
+	MSAndroidCamera2CaptureZoom zoom = *(MSAndroidCamera2CaptureZoom *)arg;
+	if (zoom.factor < 1 || zoom.centerX < 0 || zoom.centerX > 1 || zoom.centerY < 0 || zoom.centerY > 1) {
+		ms_error("[Camera2 Capture] Invalid zoom %f centered on %f,%f", zoom.factor, zoom.centerX, zoom.centerY);
+		return -1;
+	}
+
+	ms_filter_lock(f);
+	d->zoom = zoom;
+	// Request is updated live, no need to restart the session
+	if (d->capturing && d->captureSession && d->capturePreviewRequest) {
+		android_camera2_capture_apply_crop_region(d);
+		android_camera2_capture_set_repeating_request(d);
+	}
+	ms_filter_unlock(f);
+	return 0;
+}
+
+static int android_camera2_capture_get_zoom(MSFilter *f, void* arg) {
+	AndroidCamera2Context *d = (AndroidCamera2Context *)f->data;
+	ms_filter_lock(f);
+	*(MSAndroidCamera2CaptureZoom *)arg = d->zoom;
+	ms_filter_unlock(f);
+	return 0;
+}
+
+static int android_camera2_capture_set_worker(MSFilter *f, void* arg) {
+	AndroidCamera2Context *d = (AndroidCamera2Context *)f->data;
+	MSAndroidCamera2CaptureWorkerConfig config = *(MSAndroidCamera2CaptureWorkerConfig *)arg;
+	if (config.niceness < -20 || config.niceness > 19) {
+		ms_error("[Camera2 Capture] Invalid worker niceness %d", config.niceness);
+		return -1;
+	}
+
+	ms_filter_lock(f);
+	d->workerConfig = config;
+	ms_filter_unlock(f);
+	ms_message("[Camera2 Capture] Conversion worker %s, CPU mask %x, niceness %d, real-time %s", config.enabled ? "enabled" : "disabled",
+		config.cpuMask, config.niceness, config.realtime ? "yes" : "no");
+
+	// Worker is started and stopped with the session
+	if (d->capturing) {
+		android_camera2_capture_reconfigure(d, true);
+	}
+	return 0;
+}
+
+static int android_camera2_capture_get_worker(MSFilter *f, void* arg) {
+	AndroidCamera2Context *d = (AndroidCamera2Context *)f->data;
+	ms_filter_lock(f);
+	*(MSAndroidCamera2CaptureWorkerConfig *)arg = d->workerConfig;
+	ms_filter_unlock(f);
+	return 0;
+}
+
+static int android_camera2_capture_set_pacing(MSFilter *f, void* arg) {
+	AndroidCamera2Context *d = (AndroidCamera2Context *)f->data;
+	MSAndroidCamera2CapturePacing pacing = *(MSAndroidCamera2CapturePacing *)arg;
+	if (pacing.depth < 1 || pacing.depth > ANDROID_CAMERA2_PACING_MAX_DEPTH || pacing.latency < 0) {
+		ms_error("[Camera2 Capture] Invalid pacing depth %d or latency %d", pacing.depth, pacing.latency);
+		return -1;
+	}
+
+	ms_mutex_lock(&d->mutex);
+	if (d->frame) {
+		freemsg(d->frame);
+		d->frame = NULL;
+	}
+	android_camera2_capture_flush_paced_frames(d);
+	d->pacing = pacing;
+	d->pacingLatency = 0;
+	ms_mutex_unlock(&d->mutex);
+	// Push mode is stopped or started again by the next process()
+	ms_message("[Camera2 Capture] Frame pacing %s, depth %d, latency %dms", pacing.enabled ? "enabled" : "disabled", pacing.depth, pacing.latency);
+	return 0;
+}
+
+static int android_camera2_capture_get_pacing(MSFilter *f, void* arg) {
+	AndroidCamera2Context *d = (AndroidCamera2Context *)f->data;
+	ms_mutex_lock(&d->mutex);
+	*(MSAndroidCamera2CapturePacing *)arg = d->pacing;
+	ms_mutex_unlock(&d->mutex);
+	return 0;
+}
+
+static int android_camera2_capture_set_scene_detection(MSFilter *f, void* arg) {
+	AndroidCamera2Context *d = (AndroidCamera2Context *)f->data;
+	MSAndroidCamera2CaptureSceneDetection sceneDetection = *(MSAndroidCamera2CaptureSceneDetection *)arg;
+	if (sceneDetection.staticThreshold < 0 || sceneDetection.sceneChangeThreshold < sceneDetection.staticThreshold || sceneDetection.keepAliveInterval < 0) {
+		ms_error("[Camera2 Capture] Invalid scene detection thresholds %f/%f or keep alive interval %d",
+			sceneDetection.staticThreshold, sceneDetection.sceneChangeThreshold, sceneDetection.keepAliveInterval);
+		return -1;
+	}
+
+	// Converting thread reads it without lock, a stale value for one frame is harmless
+	ms_filter_lock(f);
+	d->sceneDetection = sceneDetection;
+	ms_filter_unlock(f);
+	ms_message("[Camera2 Capture] Scene detection %s, static frames %s under %f, scene change above %f, keep alive every %dms",
+		sceneDetection.enabled ? "enabled" : "disabled", sceneDetection.dropStaticFrames ? "dropped" : "marked",
+		sceneDetection.staticThreshold, sceneDetection.sceneChangeThreshold, sceneDetection.keepAliveInterval);
+	return 0;
+}
+
+static int android_camera2_capture_get_scene_detection(MSFilter *f, void* arg) {
 	AndroidCamera2Context *d = (AndroidCamera2Context *)f->data;
-	d->fps = *((float*)arg);
-	snprintf(d->fps_context, sizeof(d->fps_context), "Captured mean fps=%%f, expected=%f", d->fps);
 	ms_filter_lock(f);
-	ms_video_init_framerate_controller(&d->fpsControl, d->fps);
-	ms_video_init_average_fps(&d->averageFps, d->fps_context);
+	*(MSAndroidCamera2CaptureSceneDetection *)arg = d->sceneDetection;
 	ms_filter_unlock(f);
 	return 0;
 }
 
-static int android_camera2_capture_get_fps(MSFilter *f, void *arg) {
-	AndroidCamera2Context *d = (AndroidCamera2Context *)f->data;
-	*((float*)arg) = ms_average_fps_get(&d->averageFps);
+static int android_camera2_capture_set_trace_flags(MSFilter *f, void* arg) {
+	android_camera2_trace_set_flags(*(int *)arg);
 	return 0;
 }
 
-static void android_camera2_capture_choose_best_configurations(AndroidCamera2Context *d) {
-	ms_message("[Camera2 Capture] Listing camera %s configurations", d->device->camId);
-
-    ACameraMetadata *cameraMetadata = nullptr;
-	camera_status_t camera_status = ACameraManager_getCameraCharacteristics(d->cameraManager, d->device->camId, &cameraMetadata);
-	if (camera_status != ACAMERA_OK) {
-		ms_error("[Camera2 Capture] Failed to get camera characteristics, error is %s", android_camera2_status_to_string(camera_status));
-		return;
-	}
-
-	ACameraMetadata_const_entry supportedFpsRanges;
-	ACameraMetadata_getConstEntry(cameraMetadata, ACAMERA_CONTROL_AE_AVAILABLE_TARGET_FPS_RANGES, &supportedFpsRanges);
-	for (int i = 0; i < supportedFpsRanges.count; i += 2) {
-		int32_t min = supportedFpsRanges.data.i32[i];
-		int32_t max = supportedFpsRanges.data.i32[i + 1];
-		ms_message("[Camera2 Capture] Supported FPS range: [%d-%d]", min, max);
-	}
-	
-	ACameraMetadata_const_entry scaler;
-	ACameraMetadata_getConstEntry(cameraMetadata, ACAMERA_SCALER_AVAILABLE_STREAM_CONFIGURATIONS, &scaler);
-	
-	MSVideoSize backupSize;
-	backupSize.width = 0;
-	backupSize.height = 0;
-	double askedRatio = d->captureSize.width * d->captureSize.height;
-	bool found = false;
-	
-	for (int i = 0; i < scaler.count; i += 4) {
-		int32_t input = scaler.data.i32[i + 3];
-		int32_t format = scaler.data.i32[i + 0];
-		if (input) continue;
+static int android_camera2_capture_dump_trace(MSFilter *f, void* arg) {
+	return android_camera2_trace_dump((const char *)arg);
+}
 
-		if (format == d->captureFormat) {
-			int32_t width = scaler.data.i32[i + 1];
-			int32_t height = scaler.data.i32[i + 2];
-			double currentSizeRatio = width * height;
-			ms_message("[Camera2 Capture] Available size width %d, height %d for requested format %d", width, height, format);
+static int android_camera2_capture_prewarm(MSFilter *f, void* arg) {
+	AndroidCamera2Context *d = (AndroidCamera2Context *)f->data;
+	bool enable = *(int *)arg != 0;
 
-			if (width == d->captureSize.width && height == d->captureSize.height) {
-				found = true;
-			} else {
-				double backupRatio = backupSize.width * backupSize.height;
-				if (backupRatio == 0 || fabs(askedRatio - currentSizeRatio) < fabs(askedRatio - backupRatio)) {
-					// Current resolution is closer to the one we want than the one in backup, update backup
-					backupSize.width = width;
-					backupSize.height = height;
-				}
-			}
-		} else {
-			int32_t width = scaler.data.i32[i + 1];
-			int32_t height = scaler.data.i32[i + 2];
-			ms_debug("[Camera2 Capture] Available size width %d, height %d for format %d", width, height, format);
+	if (!enable) {
+		if (d->prewarmed && !d->capturing) {
+			ms_message("[Camera2 Capture] Releasing pre-warmed camera");
+			android_camera2_capture_reconfigure(d, false);
 		}
+		return 0;
 	}
 
-	if (found) {
-		ms_message("[Camera2 Capture] Found exact match for our required size of %ix%i", d->captureSize.width, d->captureSize.height);
-	} else {
-		// Asked resolution not found
-		d->captureSize.width = backupSize.width;
-		d->captureSize.height = backupSize.height;
-		ms_warning("[Camera2 Capture] Couldn't find requested resolution, instead using %ix%i", backupSize.width, backupSize.height);
+	if (!d->device) {
+		ms_error("[Camera2 Capture] Can't pre-warm, no device selected");
+		return -1;
 	}
 
-	ACameraMetadata_free(cameraMetadata);
-}
-
-static void android_camera2_capture_create_surface_from_surface_texture(AndroidCamera2Context *d) {
-	JNIEnv *env = ms_get_jni_env();
-	jobject surface = nullptr;
-	jobject surfaceTexture = d->nativeWindowId;
-
-	jclass surfaceTextureClass = env->FindClass("android/graphics/SurfaceTexture");
-	if (!surfaceTextureClass) {
-		ms_error("[Camera2 Capture] Could not find android.graphics.SurfaceTexture class");
-		return;
+	ms_filter_lock(f);
+	if (d->capturing || d->prewarmed) {
+		ms_filter_unlock(f);
+		return 0;
 	}
 
-	jclass surfaceClass = env->FindClass("android/view/Surface");
-	if (!surfaceClass) {
-		ms_error("[Camera2 Capture] Could not find android.view.Surface class");
-		return;
+	ms_message("[Camera2 Capture] Pre-warming camera %s", d->device->camId);
+	if (d->configured) {
+		if (!android_camera2_capture_create_session(d)) {
+			ms_error("[Camera2 Capture] Couldn't pre-warm capture session");
+			android_camera2_capture_release_session(d);
+			android_camera2_capture_release_image_reader(d);
+			android_camera2_capture_close_camera(d);
+			ms_filter_unlock(f);
+			return -1;
+		}
+		d->prewarmed = true;
+		ms_message("[Camera2 Capture] Pre-warm: preview creation %llums, camera open %llums, session creation %llums",
+			(unsigned long long)d->previewCreationDuration, (unsigned long long)d->cameraOpenDuration, (unsigned long long)d->sessionCreationDuration);
+	} else {
+		// Session needs the video size and the preview window, open the device only, it is kept open until they are set
+		android_camera2_capture_open_camera(d);
+		d->prewarmed = d->cameraDevice != nullptr;
 	}
+	ms_filter_unlock(f);
 
-	jclass textureViewClass = env->FindClass("android/view/TextureView");
-	if (!textureViewClass) {
-		ms_error("[Camera2 Capture] Could not find android.view.TextureView class");
-		return;
-	}
+	return d->prewarmed ? 0 : -1;
+}
 
-	if (env->IsInstanceOf(surfaceTexture, surfaceClass)) {
-		ms_message("[Camera2 Capture] NativePreviewWindowId %p is a Surface, using it directly", surfaceTexture);
-		d->surface = (jobject)env->NewGlobalRef(surfaceTexture);
-		return;
-	}
+static int android_camera2_capture_restart(MSFilter *f, void* arg) {
+	AndroidCamera2Context *d = (AndroidCamera2Context *)f->data;
 
-	if (env->IsInstanceOf(surfaceTexture, textureViewClass)) {
-		ms_message("[Camera2 Capture] NativePreviewWindowId %p is a TextureView", surfaceTexture);
+	ms_message("[Camera2 Capture] Restarting capture");
+	android_camera2_capture_reconfigure(d, false);
+	return 0;
+}
 
-		jmethodID getSurfaceTexture = env->GetMethodID(textureViewClass, "getSurfaceTexture", "()Landroid/graphics/SurfaceTexture;");
-		surfaceTexture = env->CallObjectMethod(d->nativeWindowId, getSurfaceTexture);
-		if (surfaceTexture == nullptr) {
-			ms_error("[Camera2 Capture] TextureView isn't available !");
-			return;
-		}
-		ms_message("[Camera2 Capture] Got SurfaceTexture %p from TextureView %p", surfaceTexture, d->nativeWindowId);
-	}
+static int android_camera2_capture_set_suspend(MSFilter *f, void* arg) {
+	AndroidCamera2Context *d = (AndroidCamera2Context *)f->data;
+	MSAndroidCamera2CaptureSuspend *suspend = (MSAndroidCamera2CaptureSuspend *)arg;
 
-	if (surfaceTexture != nullptr) {
-		if (d->captureSize.width != 0 && d->captureSize.height != 0) {
-			jmethodID setDefaultBufferSize = env->GetMethodID(surfaceTextureClass, "setDefaultBufferSize", "(II)V");
-			env->CallVoidMethod(surfaceTexture, setDefaultBufferSize, d->captureSize.width, d->captureSize.height);
-			ms_message("[Camera2 Capture] Set default buffer size for SurfaceTexture %p to %ix%i", surfaceTexture, d->captureSize.width, d->captureSize.height);
-		} else {
-			ms_warning("[Camera2 Capture] SurfaceTexture buffer size not available yet, aborting for now, will come back later");
-			d->surface = nullptr;
-			return;
-		}
+	ms_filter_lock(f);
+	d->suspend = *suspend;
+	if (d->suspend.fps <= 0) d->suspend.fps = 1;
+	if (suspend->suspended) {
+		android_camera2_capture_suspend(d);
+	} else {
+		android_camera2_capture_resume(d);
 	}
+	ms_filter_unlock(f);
 
-	jmethodID ctor = env->GetMethodID(surfaceClass, "<init>", "(Landroid/graphics/SurfaceTexture;)V");
-	surface = env->NewObject(surfaceClass, ctor, surfaceTexture);
-	if (!surface) {
-		ms_error("[Camera2 Capture] Could not instanciate android.view.Surface object");
-		return;
-	}
-	d->surface = (jobject)env->NewGlobalRef(surface);
-	ms_message("[Camera2 Capture] Got Surface %p from SurfaceTexture %p",  d->surface, surfaceTexture);
+	return 0;
 }
 
-static int android_camera2_capture_set_surface_texture(MSFilter *f, void *arg) {
+static int android_camera2_capture_get_suspend(MSFilter *f, void* arg) {
 	AndroidCamera2Context *d = (AndroidCamera2Context *)f->data;
-	unsigned long id = *(unsigned long *)arg;
-	jobject nativeWindowId = (jobject)id;
-	JNIEnv *env = ms_get_jni_env();
-
+	MSAndroidCamera2CaptureSuspend *suspend = (MSAndroidCamera2CaptureSuspend *)arg;
 	ms_filter_lock(f);
-	jobject currentWindowId = d->nativeWindowId;
+	*suspend = d->suspend;
+	suspend->suspended = d->suspended;
 	ms_filter_unlock(f);
+	return 0;
+}
 
-	ms_message("[Camera2 Capture] New native window ptr is %p, current one is %p", nativeWindowId, currentWindowId);
-	if (id == 0) {
-		if (currentWindowId) {
-			android_camera2_capture_stop(d);
-			env->DeleteGlobalRef(currentWindowId);
-			d->nativeWindowId = nullptr;
-		}
-	} else if (!env->IsSameObject(currentWindowId, nativeWindowId)) {
-		if (currentWindowId) {
-			android_camera2_capture_stop(d);
-			env->DeleteGlobalRef(currentWindowId);
-		}
-		
-		d->nativeWindowId = env->NewGlobalRef(nativeWindowId);
-		android_camera2_capture_create_surface_from_surface_texture(d);
-		
-		ms_filter_lock(f);
-		android_camera2_check_configuration_ok(d);
-		ms_filter_unlock(f);
+static int android_camera2_capture_set_raw_dump(MSFilter *f, void* arg) {
+	AndroidCamera2Context *d = (AndroidCamera2Context *)f->data;
+	const char *path = (const char *)arg;
 
-		if (d->previewSize.width != 0 && d->previewSize.height != 0) {
-			ms_filter_notify(f, MS_CAMERA_PREVIEW_SIZE_CHANGED, &d->previewSize);
-		}
-	} else {
-		ms_message("[Camera2 Capture] New native window is the same as the current one, skipping...");
+	AndroidCamera2DumpWriter *writer = nullptr;
+	if (path) {
+		writer = android_camera2_dump_writer_open(path);
+		if (!writer) return -1;
 	}
 
-	return 0; 
+	ms_mutex_lock(&d->dumpMutex);
+	AndroidCamera2DumpWriter *previous = d->dumpWriter;
+	d->dumpWriter = writer;
+	ms_mutex_unlock(&d->dumpMutex);
+
+	if (previous) android_camera2_dump_writer_close(previous);
+	return 0;
 }
 
-static int android_camera2_capture_set_vsize(MSFilter *f, void* arg) {
+static int android_camera2_capture_set_replay(MSFilter *f, void* arg) {
 	AndroidCamera2Context *d = (AndroidCamera2Context *)f->data;
-
-	MSVideoSize requestedSize = *(MSVideoSize*)arg;
-	if (d->captureSize.width == requestedSize.width && d->captureSize.height == requestedSize.height) {
-		return -1;
+	MSAndroidCamera2CaptureReplay *replay = (MSAndroidCamera2CaptureReplay *)arg;
+
+	AndroidCamera2DumpReader *reader = nullptr;
+	AndroidCamera2RawFrame frame;
+	if (replay->file) {
+		reader = android_camera2_dump_reader_open(replay->file);
+		if (!reader) return -1;
+		if (!android_camera2_dump_reader_next(reader, &frame)) {
+			ms_error("[Camera2 Capture] Raw dump %s has no frame", replay->file);
+			android_camera2_dump_reader_close(reader);
+			return -1;
+		}
 	}
-	
-	MSVideoSize oldSize;
-	oldSize.width = d->captureSize.width;
-	oldSize.height = d->captureSize.height;
-	d->captureSize = requestedSize;
 
 	android_camera2_capture_stop(d);
-	android_camera2_capture_choose_best_configurations(d);
 
-	int orientation = android_camera2_capture_get_orientation(d);
-	if (orientation % 180 == 0) {
-		d->previewSize.width = d->captureSize.width;
-		d->previewSize.height = d->captureSize.height;
+	ms_filter_lock(f);
+	if (d->replayReader) {
+		android_camera2_dump_reader_close(d->replayReader);
+		d->replayReader = nullptr;
+		d->captureSize = d->cameraCaptureSize;
+	}
+	if (reader) {
+		d->cameraCaptureSize = d->captureSize;
+		d->replayReader = reader;
+		d->replay = *replay;
+		d->replay.file = nullptr;
+		d->captureSize.width = frame.width;
+		d->captureSize.height = frame.height;
+		ms_message("[Camera2 Capture] Replaying %ix%i raw dump %s", frame.width, frame.height, replay->file);
 	} else {
-		d->previewSize.width = d->captureSize.height;
-		d->previewSize.height = d->captureSize.width;
+		ms_message("[Camera2 Capture] Replay stopped, capturing from the camera");
 	}
+	android_camera2_capture_get_output_size(d);
+	android_camera2_check_configuration_ok(d);
+	ms_filter_unlock(f);
 
 	if (d->previewSize.width != 0 && d->previewSize.height != 0) {
 		ms_filter_notify(f, MS_CAMERA_PREVIEW_SIZE_CHANGED, &d->previewSize);
 	}
+	return 0;
+}
 
-	ms_message("[Camera2 Capture] Previous preview size was %i/%i, new size is %i/%i", 
-		oldSize.width, oldSize.height, d->previewSize.width, d->previewSize.height);
+static int android_camera2_capture_set_face_detection(MSFilter *f, void* arg) {
+	AndroidCamera2Context *d = (AndroidCamera2Context *)f->data;
 
-	if (d->surface == nullptr && d->nativeWindowId != 0) {
-		ms_warning("[Camera2 Capture] Video size has changed after video window id has been set, have to recreate Surface object...");
-		android_camera2_capture_create_surface_from_surface_texture(d);
+	ms_filter_lock(f);
+	d->faceDetection = *(int *)arg != 0;
+	// Request is updated live, no need to restart the session
+	if (d->capturing && d->captureSession && d->capturePreviewRequest) {
+		android_camera2_capture_apply_face_detection(d);
+		android_camera2_capture_set_repeating_request(d);
 	}
+	ms_filter_unlock(f);
+	return 0;
+}
 
+static int android_camera2_capture_get_face_detection(MSFilter *f, void* arg) {
+	AndroidCamera2Context *d = (AndroidCamera2Context *)f->data;
 	ms_filter_lock(f);
-	android_camera2_check_configuration_ok(d);
+	*(int *)arg = d->faceDetection && d->faceDetectionSupported;
 	ms_filter_unlock(f);
-
 	return 0;
 }
 
-static int android_camera2_capture_get_vsize(MSFilter *f, void* arg) {
+static int android_camera2_capture_set_push_mode(MSFilter *f, void* arg) {
 	AndroidCamera2Context *d = (AndroidCamera2Context *)f->data;
 
 	ms_filter_lock(f);
-	int orientation = android_camera2_capture_get_orientation(d);
-	if (orientation % 180 == 0) {
-		d->previewSize.width = d->captureSize.width;
-		d->previewSize.height = d->captureSize.height;
-	} else {
-		d->previewSize.width = d->captureSize.height;
-		d->previewSize.height = d->captureSize.width;
+	// Applied by the next process(), on the ticker thread
+	d->pushMode = *(int *)arg != 0;
+	d->emitLatency = 0;
+	d->maxEmitLatency = 0;
+	ms_filter_unlock(f);
+	return 0;
+}
+
+static int android_camera2_capture_get_push_mode(MSFilter *f, void* arg) {
+	AndroidCamera2Context *d = (AndroidCamera2Context *)f->data;
+	*(int *)arg = d->pushMode;
+	return 0;
+}
+
+static int android_camera2_capture_set_high_frame_rate(MSFilter *f, void* arg) {
+	AndroidCamera2Context *d = (AndroidCamera2Context *)f->data;
+	MSAndroidCamera2CaptureHighFrameRate config = *(MSAndroidCamera2CaptureHighFrameRate *)arg;
+	if (config.fps < 0 || config.minFps < 0 || (config.fps > 0 && config.minFps > config.fps)) {
+		ms_error("[Camera2 Capture] Invalid high frame rate configuration, fps %d, min fps %d", config.fps, config.minFps);
+		return -1;
 	}
+
+	ms_filter_lock(f);
+	bool changed = config.enabled != d->highFrameRate.enabled || (config.enabled && (config.fps != d->highFrameRate.fps || config.minFps != d->highFrameRate.minFps));
+	d->highFrameRate.enabled = config.enabled;
+	d->highFrameRate.fps = config.fps;
+	d->highFrameRate.minFps = config.minFps;
 	ms_filter_unlock(f);
 
-	*(MSVideoSize*)arg = d->previewSize;
-	ms_message("[Camera2 Capture] Getting preview size: %ix%i", d->previewSize.width, d->previewSize.height);
+	ms_message("[Camera2 Capture] High frame rate %s, target %d fps, min %d fps", config.enabled ? "enabled" : "disabled",
+		config.fps > 0 ? config.fps : 60, config.minFps > 0 ? config.minFps : 30);
+	// Ranges and size are chosen with the capture size, the session is created again with them
+	if (changed && d->device && d->requestedCaptureSize.width != 0 && d->requestedCaptureSize.height != 0 && !d->replayReader) {
+		android_camera2_capture_change_capture_size(d, d->requestedCaptureSize);
+	}
+	return 0;
+}
 
+static int android_camera2_capture_get_high_frame_rate(MSFilter *f, void* arg) {
+	AndroidCamera2Context *d = (AndroidCamera2Context *)f->data;
+	ms_filter_lock(f);
+	*(MSAndroidCamera2CaptureHighFrameRate *)arg = d->highFrameRate;
+	ms_filter_unlock(f);
 	return 0;
 }
 
@@ -898,14 +3467,47 @@ static int android_camera2_capture_set_device_rotation(MSFilter* f, void* arg) {
 	ms_filter_lock(f);
 	int rotation = *((int*)arg);
 	d->rotation = rotation;
+	d->convertKernelDirty = true;
 	ms_filter_unlock(f);
 
 	ms_message("[Camera2 Capture] Device rotation is %i", rotation);
 	return 0;
 }
 
+static int android_camera2_capture_set_pix_fmt(MSFilter *f, void *data){
+	AndroidCamera2Context *d = (AndroidCamera2Context *)f->data;
+	MSPixFmt format = *(MSPixFmt*)data;
+	if (format != MS_YUV420P && format != MS_ANDROID_CAMERA2_PIX_FMT_GRAY8) {
+		ms_error("[Camera2 Capture] Unsupported output pixel format %d", (int)format);
+		return -1;
+	}
+
+	ms_filter_lock(f);
+	d->outputFormat = format;
+	d->convertKernelDirty = true;
+	ms_filter_unlock(f);
+	ms_message("[Camera2 Capture] Output pixel format is %s", format == MS_YUV420P ? "YUV420P" : "GRAY8");
+	return 0;
+}
+
 static int android_camera2_capture_get_pix_fmt(MSFilter *f, void *data){
-	*(MSPixFmt*)data = MS_YUV420P;
+	AndroidCamera2Context *d = (AndroidCamera2Context *)f->data;
+	*(MSPixFmt*)data = d->outputFormat;
+	return 0;
+}
+
+static int android_camera2_capture_set_luma_decimation(MSFilter *f, void *data){
+	AndroidCamera2Context *d = (AndroidCamera2Context *)f->data;
+	int decimation = *(int*)data;
+	if (decimation != 1 && decimation != 2 && decimation != 4) {
+		ms_error("[Camera2 Capture] Unsupported luma decimation %d", decimation);
+		return -1;
+	}
+
+	ms_filter_lock(f);
+	d->lumaDecimation = decimation;
+	d->convertKernelDirty = true;
+	ms_filter_unlock(f);
 	return 0;
 }
 
@@ -918,7 +3520,37 @@ static MSFilterMethod android_camera2_capture_methods[] = {
 		{ MS_FILTER_GET_VIDEO_SIZE, &android_camera2_capture_get_vsize },
 		{ MS_VIDEO_CAPTURE_SET_DEVICE_ORIENTATION, &android_camera2_capture_set_device_rotation },
 		{ MS_VIDEO_DISPLAY_SET_NATIVE_WINDOW_ID, &android_camera2_capture_set_surface_texture },
+		{ MS_FILTER_SET_PIX_FMT, &android_camera2_capture_set_pix_fmt },
 		{ MS_FILTER_GET_PIX_FMT, &android_camera2_capture_get_pix_fmt },
+		{ MS_ANDROID_CAMERA2_CAPTURE_SET_LUMA_DECIMATION, &android_camera2_capture_set_luma_decimation },
+		{ MS_ANDROID_CAMERA2_CAPTURE_SET_SCENE_DETECTION, &android_camera2_capture_set_scene_detection },
+		{ MS_ANDROID_CAMERA2_CAPTURE_GET_SCENE_DETECTION, &android_camera2_capture_get_scene_detection },
+		{ MS_ANDROID_CAMERA2_CAPTURE_SET_TRACE_FLAGS, &android_camera2_capture_set_trace_flags },
+		{ MS_ANDROID_CAMERA2_CAPTURE_DUMP_TRACE, &android_camera2_capture_dump_trace },
+		{ MS_ANDROID_CAMERA2_CAPTURE_PREWARM, &android_camera2_capture_prewarm },
+		{ MS_ANDROID_CAMERA2_CAPTURE_RESTART, &android_camera2_capture_restart },
+		{ MS_ANDROID_CAMERA2_CAPTURE_SET_SUSPEND, &android_camera2_capture_set_suspend },
+		{ MS_ANDROID_CAMERA2_CAPTURE_GET_SUSPEND, &android_camera2_capture_get_suspend },
+		{ MS_ANDROID_CAMERA2_CAPTURE_SET_RAW_DUMP, &android_camera2_capture_set_raw_dump },
+		{ MS_ANDROID_CAMERA2_CAPTURE_SET_REPLAY, &android_camera2_capture_set_replay },
+		{ MS_ANDROID_CAMERA2_CAPTURE_SET_FACE_DETECTION, &android_camera2_capture_set_face_detection },
+		{ MS_ANDROID_CAMERA2_CAPTURE_GET_FACE_DETECTION, &android_camera2_capture_get_face_detection },
+		{ MS_ANDROID_CAMERA2_CAPTURE_SET_PUSH_MODE, &android_camera2_capture_set_push_mode },
+		{ MS_ANDROID_CAMERA2_CAPTURE_GET_PUSH_MODE, &android_camera2_capture_get_push_mode },
+		{ MS_ANDROID_CAMERA2_CAPTURE_SET_HIGH_FRAME_RATE, &android_camera2_capture_set_high_frame_rate },
+		{ MS_ANDROID_CAMERA2_CAPTURE_GET_HIGH_FRAME_RATE, &android_camera2_capture_get_high_frame_rate },
+		{ MS_ANDROID_CAMERA2_CAPTURE_SET_PREVIEW_STREAM_SIZE, &android_camera2_capture_set_preview_stream_size },
+		{ MS_ANDROID_CAMERA2_CAPTURE_GET_PREVIEW_STREAM_SIZE, &android_camera2_capture_get_preview_stream_size },
+		{ MS_ANDROID_CAMERA2_CAPTURE_SET_PROFILE, &android_camera2_capture_set_profile },
+		{ MS_ANDROID_CAMERA2_CAPTURE_GET_PROFILE, &android_camera2_capture_get_profile },
+		{ MS_ANDROID_CAMERA2_CAPTURE_GET_PIPELINE_MAX_DEPTH, &android_camera2_capture_get_pipeline_max_depth },
+		{ MS_ANDROID_CAMERA2_CAPTURE_GET_STATS, &android_camera2_capture_get_stats },
+		{ MS_ANDROID_CAMERA2_CAPTURE_SET_ZOOM, &android_camera2_capture_set_zoom },
+		{ MS_ANDROID_CAMERA2_CAPTURE_GET_ZOOM, &android_camera2_capture_get_zoom },
+		{ MS_ANDROID_CAMERA2_CAPTURE_SET_WORKER, &android_camera2_capture_set_worker },
+		{ MS_ANDROID_CAMERA2_CAPTURE_GET_WORKER, &android_camera2_capture_get_worker },
+		{ MS_ANDROID_CAMERA2_CAPTURE_SET_PACING, &android_camera2_capture_set_pacing },
+		{ MS_ANDROID_CAMERA2_CAPTURE_GET_PACING, &android_camera2_capture_get_pacing },
 		{ 0, 0 }
 };
 
@@ -966,20 +3598,23 @@ void android_camera2_capture_detect(MSWebCamManager *obj) {
 	ms_message("[Camera2 Capture] Detecting cameras");
 
 	ACameraIdList *cameraIdList = nullptr;
-	ACameraMetadata *cameraMetadata = nullptr;
+	const ACameraMetadata *cameraMetadata = nullptr;
 
 	camera_status_t camera_status = ACAMERA_OK;
-	ACameraManager *cameraManager = ACameraManager_create();
+	ACameraManager *cameraManager = android_camera2_manager_acquire();
 
 	camera_status = ACameraManager_getCameraIdList(cameraManager, &cameraIdList);
 	if (camera_status != ACAMERA_OK) {
 		ms_error("[Camera2 Capture] Failed to get camera(s) list : %d", camera_status);
+		android_camera2_manager_release();
 		android_video_capture_detect_cameras_legacy(obj);
 		return;
 	}
 
 	if (cameraIdList->numCameras < 1) {
 		ms_warning("[Camera2 Capture] No camera detected !");
+		ACameraManager_deleteCameraIdList(cameraIdList);
+		android_camera2_manager_release();
 		android_video_capture_detect_cameras_legacy(obj);
 		return;
 	}
@@ -991,8 +3626,8 @@ void android_camera2_capture_detect(MSWebCamManager *obj) {
 	for (int i = 0; i < cameraIdList->numCameras; i++) {
 		camId = cameraIdList->cameraIds[i];
 
-		camera_status = ACameraManager_getCameraCharacteristics(cameraManager, camId, &cameraMetadata);
-		if (camera_status != ACAMERA_OK) {
+		cameraMetadata = android_camera2_manager_get_characteristics(camId);
+		if (!cameraMetadata) {
 			ms_error("[Camera2 Capture] Failed to get camera %s characteristics", camId);
 		} else {
 			AndroidCamera2Device *device = new AndroidCamera2Device(ms_strdup(camId));
@@ -1043,13 +3678,11 @@ void android_camera2_capture_detect(MSWebCamManager *obj) {
 			} else {
 				ms_warning("[Camera2 Capture] A camera with the same direction as already been added, skipping this one");
 			}
-
-			ACameraMetadata_free(cameraMetadata);
 		}
 	}
 
 	ACameraManager_deleteCameraIdList(cameraIdList);
-	ACameraManager_delete(cameraManager);
+	android_camera2_manager_release();
 }
 
 #ifdef _MSC_VER
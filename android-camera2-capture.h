@@ -0,0 +1,202 @@
+/*
+ * Copyright (c) 2010-2019 Belledonne Communications SARL.
+ *
+ * android-camera2-capture.h - Methods, events and types of the Android Camera2 capture filter.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ANDROID_CAMERA2_CAPTURE_H
+#define ANDROID_CAMERA2_CAPTURE_H
+
+#include <mediastreamer2/msfilter.h>
+#include <mediastreamer2/msvideo.h>
+
+/* Filter specific methods, expressed in the sensor (landscape) orientation like the capture size */
+#define MS_ANDROID_CAMERA2_CAPTURE_SET_PREVIEW_STREAM_SIZE	MS_FILTER_METHOD(MS_ANDROID_VIDEO_READ_ID, 0, MSVideoSize)
+#define MS_ANDROID_CAMERA2_CAPTURE_GET_PREVIEW_STREAM_SIZE	MS_FILTER_METHOD(MS_ANDROID_VIDEO_READ_ID, 1, MSVideoSize)
+#define MS_ANDROID_CAMERA2_CAPTURE_SET_PROFILE			MS_FILTER_METHOD(MS_ANDROID_VIDEO_READ_ID, 2, int)
+#define MS_ANDROID_CAMERA2_CAPTURE_GET_PROFILE			MS_FILTER_METHOD(MS_ANDROID_VIDEO_READ_ID, 3, int)
+#define MS_ANDROID_CAMERA2_CAPTURE_GET_PIPELINE_MAX_DEPTH	MS_FILTER_METHOD(MS_ANDROID_VIDEO_READ_ID, 4, int)
+#define MS_ANDROID_CAMERA2_CAPTURE_GET_STATS			MS_FILTER_METHOD(MS_ANDROID_VIDEO_READ_ID, 5, MSAndroidCamera2CaptureStats)
+#define MS_ANDROID_CAMERA2_CAPTURE_SET_ZOOM			MS_FILTER_METHOD(MS_ANDROID_VIDEO_READ_ID, 6, MSAndroidCamera2CaptureZoom)
+#define MS_ANDROID_CAMERA2_CAPTURE_GET_ZOOM			MS_FILTER_METHOD(MS_ANDROID_VIDEO_READ_ID, 7, MSAndroidCamera2CaptureZoom)
+#define MS_ANDROID_CAMERA2_CAPTURE_SET_WORKER			MS_FILTER_METHOD(MS_ANDROID_VIDEO_READ_ID, 8, MSAndroidCamera2CaptureWorkerConfig)
+#define MS_ANDROID_CAMERA2_CAPTURE_GET_WORKER			MS_FILTER_METHOD(MS_ANDROID_VIDEO_READ_ID, 9, MSAndroidCamera2CaptureWorkerConfig)
+#define MS_ANDROID_CAMERA2_CAPTURE_SET_PACING			MS_FILTER_METHOD(MS_ANDROID_VIDEO_READ_ID, 10, MSAndroidCamera2CapturePacing)
+#define MS_ANDROID_CAMERA2_CAPTURE_GET_PACING			MS_FILTER_METHOD(MS_ANDROID_VIDEO_READ_ID, 11, MSAndroidCamera2CapturePacing)
+#define MS_ANDROID_CAMERA2_CAPTURE_SET_LUMA_DECIMATION		MS_FILTER_METHOD(MS_ANDROID_VIDEO_READ_ID, 12, int)
+#define MS_ANDROID_CAMERA2_CAPTURE_SET_SCENE_DETECTION		MS_FILTER_METHOD(MS_ANDROID_VIDEO_READ_ID, 13, MSAndroidCamera2CaptureSceneDetection)
+#define MS_ANDROID_CAMERA2_CAPTURE_GET_SCENE_DETECTION		MS_FILTER_METHOD(MS_ANDROID_VIDEO_READ_ID, 14, MSAndroidCamera2CaptureSceneDetection)
+/* Tracing is process wide, flags are ANDROID_CAMERA2_TRACE_RECORD and/or ANDROID_CAMERA2_TRACE_ATRACE */
+#define MS_ANDROID_CAMERA2_CAPTURE_SET_TRACE_FLAGS		MS_FILTER_METHOD(MS_ANDROID_VIDEO_READ_ID, 15, int)
+#define MS_ANDROID_CAMERA2_CAPTURE_DUMP_TRACE			MS_FILTER_METHOD(MS_ANDROID_VIDEO_READ_ID, 16, const char)
+/* 1 opens the camera, and creates the session if video size and window are already set, before the graph starts. 0 releases it. */
+#define MS_ANDROID_CAMERA2_CAPTURE_PREWARM			MS_FILTER_METHOD(MS_ANDROID_VIDEO_READ_ID, 17, int)
+/* Tears down the session and closes the camera, next process() starts the capture again from scratch */
+#define MS_ANDROID_CAMERA2_CAPTURE_RESTART			MS_FILTER_METHOD_NO_ARG(MS_ANDROID_VIDEO_READ_ID, 18)
+/*
+ * Stops the sensor while keeping the camera and the session open, for instance while video is muted.
+ * Settings changed while suspended (zoom, face detection, ...) are applied to the request and used on resume.
+ */
+#define MS_ANDROID_CAMERA2_CAPTURE_SET_SUSPEND			MS_FILTER_METHOD(MS_ANDROID_VIDEO_READ_ID, 19, MSAndroidCamera2CaptureSuspend)
+#define MS_ANDROID_CAMERA2_CAPTURE_GET_SUSPEND			MS_FILTER_METHOD(MS_ANDROID_VIDEO_READ_ID, 20, MSAndroidCamera2CaptureSuspend)
+/* Path of the file to append the raw images delivered by the HAL to, NULL to stop dumping */
+#define MS_ANDROID_CAMERA2_CAPTURE_SET_RAW_DUMP			MS_FILTER_METHOD(MS_ANDROID_VIDEO_READ_ID, 21, const char)
+#define MS_ANDROID_CAMERA2_CAPTURE_SET_REPLAY			MS_FILTER_METHOD(MS_ANDROID_VIDEO_READ_ID, 22, MSAndroidCamera2CaptureReplay)
+/* ISP face detection, enabled by default when the device supports it. Get returns whether it is actually running. */
+#define MS_ANDROID_CAMERA2_CAPTURE_SET_FACE_DETECTION		MS_FILTER_METHOD(MS_ANDROID_VIDEO_READ_ID, 23, int)
+#define MS_ANDROID_CAMERA2_CAPTURE_GET_FACE_DETECTION		MS_FILTER_METHOD(MS_ANDROID_VIDEO_READ_ID, 24, int)
+/*
+ * 1 wakes the ticker as soon as a frame is converted instead of waiting for the next tick, ignored while pacing is enabled.
+ * Takes effect from the next tick, the ticker's wait function is only replaced from the ticker thread.
+ * The wait between ticks belongs to the whole ticker: every graph attached to the filter's ticker runs early with it, up to
+ * one tick interval ahead of time. Attach the capture graph to a ticker of its own if the others must keep a fixed cadence.
+ */
+#define MS_ANDROID_CAMERA2_CAPTURE_SET_PUSH_MODE		MS_FILTER_METHOD(MS_ANDROID_VIDEO_READ_ID, 25, int)
+#define MS_ANDROID_CAMERA2_CAPTURE_GET_PUSH_MODE		MS_FILTER_METHOD(MS_ANDROID_VIDEO_READ_ID, 26, int)
+/* Restarts the capture, the capture size may be lowered to one the sensor can deliver at the high frame rate */
+#define MS_ANDROID_CAMERA2_CAPTURE_SET_HIGH_FRAME_RATE		MS_FILTER_METHOD(MS_ANDROID_VIDEO_READ_ID, 27, MSAndroidCamera2CaptureHighFrameRate)
+#define MS_ANDROID_CAMERA2_CAPTURE_GET_HIGH_FRAME_RATE		MS_FILTER_METHOD(MS_ANDROID_VIDEO_READ_ID, 28, MSAndroidCamera2CaptureHighFrameRate)
+
+/* Filter specific events */
+#define MS_ANDROID_CAMERA2_CAPTURE_SCENE_CHANGED		MS_FILTER_EVENT_NO_ARG(MS_ANDROID_VIDEO_READ_ID, 0)
+/* Sent right after each frame is queued on the output while face detection runs, with the regions of interest of that frame */
+#define MS_ANDROID_CAMERA2_CAPTURE_FACES_DETECTED		MS_FILTER_EVENT(MS_ANDROID_VIDEO_READ_ID, 1, MSAndroidCamera2CaptureFaces)
+/*
+ * Sent when the sensor doesn't deliver the high frame rate and a lower one is programmed, with the new rate in fps.
+ * Sent once with the unchanged rate when the lowest range isn't delivered either, the rate isn't checked anymore then.
+ */
+#define MS_ANDROID_CAMERA2_CAPTURE_FRAME_RATE_FALLBACK		MS_FILTER_EVENT(MS_ANDROID_VIDEO_READ_ID, 2, int)
+
+/*
+ * Luma only output, one byte per pixel, for analytics consumers (motion or presence detection) that don't need chroma.
+ * Mediastreamer2 has no such pixel format, so it is negotiated with MS_FILTER_SET_PIX_FMT using a value out of the MSPixFmt range.
+ */
+#define MS_ANDROID_CAMERA2_PIX_FMT_GRAY8 ((MSPixFmt)0x100)
+
+typedef enum _MSAndroidCamera2CaptureProfile {
+	MSAndroidCamera2CaptureProfileLowLatency, // TEMPLATE_PREVIEW, fast noise reduction and edge, no stabilization
+	MSAndroidCamera2CaptureProfileBalanced, // TEMPLATE_RECORD, fast noise reduction and edge, no stabilization
+	MSAndroidCamera2CaptureProfileQuality, // TEMPLATE_RECORD, high quality noise reduction and edge, stabilization if available
+	MSAndroidCamera2CaptureProfileDefault // TEMPLATE_RECORD with the template values, the default
+} MSAndroidCamera2CaptureProfile;
+
+typedef struct _MSAndroidCamera2CaptureStats {
+	int64_t capturedFrames; // capture results completed by the HAL
+	int64_t halDroppedFrames; // captures failed or buffers lost, as reported by the HAL
+	int64_t sensorSkippedFrames; // holes in the sensor timestamps, sensor didn't keep up with the requested rate
+	int64_t readerDroppedFrames; // started by the HAL but never acquired from the image reader
+	int64_t pluginDroppedFrames; // converted but replaced before process() could emit them
+	float requestedFrameDuration; // ms, from the AE target fps range of the results
+	float actualFrameDuration; // ms, average interval between sensor timestamps
+	float sensorFrameDuration; // ms, last ACAMERA_SENSOR_FRAME_DURATION
+	float exposureTime; // ms, last ACAMERA_SENSOR_EXPOSURE_TIME
+	int64_t convertedFrames;
+	float callbackCpuTime; // ms, CPU time spent in the image reader callback thread
+	float conversionCpuTime; // ms, CPU time spent acquiring and converting images, whatever the thread
+	float pacingLatency; // ms, average time frames waited in the pacing buffer
+	int64_t staticFrames; // near-identical to the previous one, dropped or marked depending on the scene detection mode
+	int64_t sceneChanges;
+	float sceneDifference; // last mean absolute luma difference with the previous frame, 0 to 255
+	float timeToFirstFrame; // ms, from process() starting the capture to the first converted frame, for the last start
+	// ms, average time from the sensor capture of a frame to its sending, pacing disabled. Exact when the sensor timestamps
+	// are in the boot time base, otherwise counted from the fastest capture to conversion delay seen since the start
+	float emitLatency;
+	float maxEmitLatency; // ms
+	int64_t captureStarts; // successful starts since the filter was created, not reset with the other stats
+} MSAndroidCamera2CaptureStats;
+
+typedef struct _MSAndroidCamera2CaptureZoom {
+	float factor; // 1 is no zoom, clamped to the device max digital zoom
+	float centerX; // center of the zoomed region, 0 to 1 relative to the sensor width, 0.5 is centered
+	float centerY; // center of the zoomed region, 0 to 1 relative to the sensor height, 0.5 is centered
+} MSAndroidCamera2CaptureZoom;
+
+typedef struct _MSAndroidCamera2CaptureWorkerConfig {
+	bool_t enabled; // acquire and convert images on a dedicated thread, the image reader callback only signals it
+	int cpuMask; // CPUs the worker is allowed to run on, 0 to select the ones with the highest max frequency
+	int niceness; // -20 (highest) to 19, used when real-time scheduling isn't requested or allowed
+	bool_t realtime; // try SCHED_FIFO, usually refused to applications, niceness is used then
+} MSAndroidCamera2CaptureWorkerConfig;
+
+#define ANDROID_CAMERA2_PACING_MAX_DEPTH 3
+
+typedef struct _MSAndroidCamera2CapturePacing {
+	bool_t enabled; // release frames on an even cadence derived from the fps and the sensor timestamps
+	int depth; // 1 to ANDROID_CAMERA2_PACING_MAX_DEPTH frames buffered, oldest is dropped when full
+	int latency; // ms added on top of the capture time before a frame is released, absorbs HAL bursts
+} MSAndroidCamera2CapturePacing;
+
+/*
+ * Static frames are either dropped, or sent with the user flag set (mblk_get_user_flag()) so the encoder can skip work.
+ * Scene changes are sent with the independent flag set (mblk_get_independent_flag()) and trigger MS_ANDROID_CAMERA2_CAPTURE_SCENE_CHANGED.
+ */
+typedef struct _MSAndroidCamera2CaptureSceneDetection {
+	bool_t enabled;
+	bool_t dropStaticFrames;
+	float staticThreshold; // mean absolute luma difference under which a frame is considered static
+	float sceneChangeThreshold; // mean absolute luma difference above which a frame is considered a scene change
+	int keepAliveInterval; // ms, a static frame is still sent at least this often when they are dropped
+} MSAndroidCamera2CaptureSceneDetection;
+
+typedef enum _MSAndroidCamera2CaptureSuspendOutput {
+	MSAndroidCamera2CaptureSuspendOutputNone, // nothing is sent while suspended
+	MSAndroidCamera2CaptureSuspendOutputLastFrame, // last frame sent before suspending, black if there is none
+	MSAndroidCamera2CaptureSuspendOutputBlack
+} MSAndroidCamera2CaptureSuspendOutput;
+
+typedef struct _MSAndroidCamera2CaptureSuspend {
+	bool_t suspended;
+	MSAndroidCamera2CaptureSuspendOutput output;
+	float fps; // rate of the frames sent while suspended, 0 for the default of 1 fps
+} MSAndroidCamera2CaptureSuspend;
+
+typedef struct _MSAndroidCamera2CaptureReplay {
+	const char *file; // raw dump to convert and send instead of the camera images, NULL to capture from the camera again
+	bool_t maxSpeed; // convert frames as fast as possible, ignoring the recorded timing and the fps
+	bool_t loop; // start over at the end of the dump
+} MSAndroidCamera2CaptureReplay;
+
+#define MS_ANDROID_CAMERA2_CAPTURE_MAX_FACES 8
+
+typedef struct _MSAndroidCamera2CaptureFace {
+	int x; // in output frame pixels, after rotation and scaling
+	int y;
+	int width;
+	int height;
+	int score; // 1 to 100, confidence given by the HAL
+} MSAndroidCamera2CaptureFace;
+
+typedef struct _MSAndroidCamera2CaptureFaces {
+	uint32_t timestamp; // 90kHz, mblk_get_timestamp_info() of the frame they belong to
+	int count; // 0 when no face is in the frame
+	MSAndroidCamera2CaptureFace faces[MS_ANDROID_CAMERA2_CAPTURE_MAX_FACES];
+} MSAndroidCamera2CaptureFaces;
+
+/*
+ * The highest AE target fps range between minFps and fps that the sensor can sustain at the capture size, or at the largest
+ * smaller size, is programmed. The filter fps is ignored while it is active. Capture results are checked every second and
+ * the next lower range is programmed if the rate isn't delivered, see MS_ANDROID_CAMERA2_CAPTURE_FRAME_RATE_FALLBACK.
+ * If programming a range fails, the template fps range is restored and high frame rate stays inactive until set again.
+ */
+typedef struct _MSAndroidCamera2CaptureHighFrameRate {
+	bool_t enabled;
+	int fps; // targeted rate, 0 for 60
+	int minFps; // lowest rate to fall back to, 0 for 30
+	int activeFps; // get only, rate currently programmed, 0 if the device has no range in [minFps, fps]
+	float deliveredFps; // get only, rate of the capture results over the last check
+} MSAndroidCamera2CaptureHighFrameRate;
+
+#endif // ANDROID_CAMERA2_CAPTURE_H
@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2010-2019 Belledonne Communications SARL.
+ *
+ * android-camera2-churn.cpp - Start, stop and resize benchmark of the Android Camera2 capture filter.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "android-camera2-churn.h"
+#include "android-camera2-capture.h"
+
+int android_camera2_churn_benchmark_run(MSFilter *f, AndroidCamera2ChurnBenchmark *benchmark) {
+	MSAndroidCamera2CaptureStats stats;
+
+	if (f->ticker == NULL) {
+		ms_error("[Camera2 Churn] Filter must be attached to a running ticker");
+		return -1;
+	}
+
+	bool alternate = benchmark->alternateSize.width != 0 && benchmark->alternateSize.height != 0;
+	float total = 0;
+	benchmark->completedIterations = 0;
+	benchmark->minTimeToFirstFrame = 0;
+	benchmark->maxTimeToFirstFrame = 0;
+	benchmark->averageTimeToFirstFrame = 0;
+
+	for (int i = 0; i < benchmark->iterations; i++) {
+		ms_filter_call_method(f, MS_ANDROID_CAMERA2_CAPTURE_GET_STATS, &stats);
+		int64_t previousStarts = stats.captureStarts;
+		uint64_t iterationStart = ms_get_cur_time_ms();
+
+		MSVideoSize size = (alternate && i % 2 == 0) ? benchmark->alternateSize : benchmark->size;
+		// Returns -1 without restarting when size doesn't change
+		if (ms_filter_call_method(f, MS_FILTER_SET_VIDEO_SIZE, &size) != 0) {
+			ms_filter_call_method_noarg(f, MS_ANDROID_CAMERA2_CAPTURE_RESTART);
+		}
+
+		// process() starts the capture again on next tick, the start counter is increased after the time to first frame is reset
+		bool delivered = false;
+		while (ms_get_cur_time_ms() - iterationStart < ANDROID_CAMERA2_CHURN_TIMEOUT) {
+			ms_filter_call_method(f, MS_ANDROID_CAMERA2_CAPTURE_GET_STATS, &stats);
+			if (stats.captureStarts > previousStarts && stats.timeToFirstFrame > 0) {
+				delivered = true;
+				break;
+			}
+			ms_usleep(5000);
+		}
+		if (!delivered) {
+			ms_warning("[Camera2 Churn] Iteration %d didn't deliver a frame in %dms", i, ANDROID_CAMERA2_CHURN_TIMEOUT);
+			continue;
+		}
+
+		if (benchmark->completedIterations == 0 || stats.timeToFirstFrame < benchmark->minTimeToFirstFrame) benchmark->minTimeToFirstFrame = stats.timeToFirstFrame;
+		if (stats.timeToFirstFrame > benchmark->maxTimeToFirstFrame) benchmark->maxTimeToFirstFrame = stats.timeToFirstFrame;
+		total += stats.timeToFirstFrame;
+		benchmark->completedIterations++;
+	}
+
+	if (alternate) {
+		ms_filter_call_method(f, MS_FILTER_SET_VIDEO_SIZE, &benchmark->size);
+	}
+	if (benchmark->completedIterations > 0) {
+		benchmark->averageTimeToFirstFrame = total / benchmark->completedIterations;
+	}
+	ms_message("[Camera2 Churn] %d/%d restarts delivered a frame, time to first frame min %.0fms, average %.0fms, max %.0fms",
+		benchmark->completedIterations, benchmark->iterations, benchmark->minTimeToFirstFrame, benchmark->averageTimeToFirstFrame, benchmark->maxTimeToFirstFrame);
+	return 0;
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2010-2019 Belledonne Communications SARL.
+ *
+ * android-camera2-churn.h - Start, stop and resize benchmark of the Android Camera2 capture filter.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ANDROID_CAMERA2_CHURN_H
+#define ANDROID_CAMERA2_CHURN_H
+
+#include <mediastreamer2/msfilter.h>
+#include <mediastreamer2/msvideo.h>
+
+/*
+ * Restarts the capture of a filter over and over and measures the time to first frame of each start, through the filter
+ * methods only. It isn't part of the plugin: test applications link it and run it on a device, from a thread of their own,
+ * once the filter has its video size and preview window and is attached to a running ticker. Each restart may block the
+ * calling thread up to ANDROID_CAMERA2_CHURN_TIMEOUT.
+ */
+
+#define ANDROID_CAMERA2_CHURN_TIMEOUT 5000 // ms
+
+typedef struct _AndroidCamera2ChurnBenchmark {
+	int iterations; // number of restarts
+	MSVideoSize size; // video size the filter was configured with, set again at the end
+	MSVideoSize alternateSize; // every other restart switches to this size, 0x0 to restart with the same size
+	int completedIterations; // restarts that delivered a frame before the timeout
+	float minTimeToFirstFrame; // ms
+	float averageTimeToFirstFrame; // ms
+	float maxTimeToFirstFrame; // ms
+} AndroidCamera2ChurnBenchmark;
+
+/* Returns 0 when the benchmark ran, whatever the number of restarts that delivered a frame */
+int android_camera2_churn_benchmark_run(MSFilter *f, AndroidCamera2ChurnBenchmark *benchmark);
+
+#endif // ANDROID_CAMERA2_CHURN_H
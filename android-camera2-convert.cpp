@@ -0,0 +1,283 @@
+/*
+ * Copyright (c) 2010-2019 Belledonne Communications SARL.
+ *
+ * android-camera2-convert.cpp - Conversion of the raw frames of the Camera2 capture pipeline.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "android-camera2-convert.h"
+
+#include <mediastreamer2/mscommon.h>
+
+#include <string.h>
+
+/*
+ * Copies the Y plane only, rotated clockwise by orientation degrees (same convention as copy_yuv_with_rotation)
+ * and decimated by keeping one pixel out of decimation in both directions. Chroma planes are never read.
+ */
+template <int Orientation>
+static mblk_t* android_camera2_copy_luma_with_rotation(const uint8_t *y, int32_t yStride, int32_t width, int32_t height, int decimation) {
+	int32_t srcWidth = width / decimation;
+	int32_t srcHeight = height / decimation;
+	int32_t dstWidth = Orientation % 180 == 0 ? srcWidth : srcHeight;
+	int32_t dstHeight = Orientation % 180 == 0 ? srcHeight : srcWidth;
+
+	mblk_t *m = allocb(dstWidth * dstHeight, 0);
+	if (!m) return nullptr;
+	uint8_t *dst = m->b_wptr;
+	int32_t rowStep = yStride * decimation;
+
+	if (Orientation == 0) {
+		for (int32_t row = 0; row < dstHeight; row++) {
+			const uint8_t *src = y + row * rowStep;
+			if (decimation == 1) {
+				memcpy(dst, src, dstWidth);
+				dst += dstWidth;
+			} else {
+				for (int32_t col = 0; col < dstWidth; col++) *dst++ = src[col * decimation];
+			}
+		}
+	} else if (Orientation == 90) {
+		for (int32_t row = 0; row < dstHeight; row++) {
+			const uint8_t *src = y + (srcHeight - 1) * rowStep + row * decimation;
+			for (int32_t col = 0; col < dstWidth; col++) *dst++ = *(src - col * rowStep);
+		}
+	} else if (Orientation == 180) {
+		for (int32_t row = 0; row < dstHeight; row++) {
+			const uint8_t *src = y + (srcHeight - 1 - row) * rowStep + (srcWidth - 1) * decimation;
+			for (int32_t col = 0; col < dstWidth; col++) *dst++ = *(src - col * decimation);
+		}
+	} else {
+		for (int32_t row = 0; row < dstHeight; row++) {
+			const uint8_t *src = y + (srcWidth - 1 - row) * decimation;
+			for (int32_t col = 0; col < dstWidth; col++) *dst++ = *(src + col * rowStep);
+		}
+	}
+	m->b_wptr = dst;
+	return m;
+}
+
+template <int Orientation>
+static mblk_t *android_camera2_convert_luma(const AndroidCamera2Converter *converter, const AndroidCamera2RawFrame *frame) {
+	return android_camera2_copy_luma_with_rotation<Orientation>(frame->planes[0].data, frame->planes[0].rowStride, frame->width, frame->height, converter->lumaDecimation);
+}
+
+/*
+ * Rotates one plane clockwise by Orientation degrees, for the layouts mediastreamer2 has no converter for. Quarter turns
+ * go through the destination eight rows at a time so that each source row is read once, sequentially, for all of them.
+ * A zero PixelStride is given at runtime, for chroma planes in an unusual layout.
+ */
+#define ANDROID_CAMERA2_ROTATE_BLOCK 8
+
+template <int Orientation, int PixelStride>
+static void android_camera2_rotate_plane(const uint8_t *src, int32_t srcStride, int32_t srcPixelStride, int32_t srcWidth, int32_t srcHeight,
+	uint8_t *dst, int32_t dstStride) {
+	const int32_t pixelStride = PixelStride != 0 ? PixelStride : srcPixelStride;
+	int32_t dstWidth = Orientation % 180 == 0 ? srcWidth : srcHeight;
+	int32_t dstHeight = Orientation % 180 == 0 ? srcHeight : srcWidth;
+
+	if (Orientation == 0) {
+		for (int32_t row = 0; row < dstHeight; row++) {
+			const uint8_t *s = src + row * srcStride;
+			uint8_t *d = dst + row * dstStride;
+			if (pixelStride == 1) {
+				memcpy(d, s, dstWidth);
+			} else {
+				for (int32_t col = 0; col < dstWidth; col++) d[col] = s[col * pixelStride];
+			}
+		}
+	} else if (Orientation == 180) {
+		for (int32_t row = 0; row < dstHeight; row++) {
+			const uint8_t *s = src + (srcHeight - 1 - row) * srcStride + (srcWidth - 1) * pixelStride;
+			uint8_t *d = dst + row * dstStride;
+			for (int32_t col = 0; col < dstWidth; col++) d[col] = *(s - col * pixelStride);
+		}
+	} else {
+		// Destination row is a source column, read from the bottom for 90 degrees and from the top for 270
+		const int32_t srcStep = Orientation == 90 ? -srcStride : srcStride;
+		const uint8_t *srcStart = Orientation == 90 ? src + (srcHeight - 1) * srcStride : src + (srcWidth - 1) * pixelStride;
+		const int32_t rowStep = Orientation == 90 ? pixelStride : -pixelStride;
+		int32_t row = 0;
+		for (; row + ANDROID_CAMERA2_ROTATE_BLOCK <= dstHeight; row += ANDROID_CAMERA2_ROTATE_BLOCK) {
+			const uint8_t *s = srcStart + row * rowStep;
+			uint8_t *d = dst + row * dstStride;
+			for (int32_t col = 0; col < dstWidth; col++) {
+				for (int k = 0; k < ANDROID_CAMERA2_ROTATE_BLOCK; k++) d[k * dstStride] = s[k * rowStep];
+				s += srcStep;
+				d++;
+			}
+		}
+		for (; row < dstHeight; row++) {
+			const uint8_t *s = srcStart + row * rowStep;
+			uint8_t *d = dst + row * dstStride;
+			for (int32_t col = 0; col < dstWidth; col++) d[col] = *(s + col * srcStep);
+		}
+	}
+}
+
+static mblk_t *android_camera2_allocate_yuv(const AndroidCamera2Converter *converter, int orientation, const AndroidCamera2RawFrame *frame, MSPicture *picture) {
+	int width = orientation % 180 == 0 ? frame->width : frame->height;
+	int height = orientation % 180 == 0 ? frame->height : frame->width;
+	return ms_yuv_buf_allocator_get(converter->bufAllocator, picture, width, height);
+}
+
+template <int Orientation>
+static void android_camera2_rotate_luma(const AndroidCamera2RawFrame *frame, const MSPicture *picture) {
+	android_camera2_rotate_plane<Orientation, 1>(frame->planes[0].data, frame->planes[0].rowStride, 1, frame->width, frame->height,
+		picture->planes[0], picture->strides[0]);
+}
+
+/*
+ * Planar and interleaved chroma, the layouts of nearly every device, go through the mediastreamer2 converters, which
+ * are NEON optimized on ARM. Their width and height are the ones of the rotated picture.
+ */
+template <int Orientation>
+static mblk_t *android_camera2_convert_yuv_planar(const AndroidCamera2Converter *converter, const AndroidCamera2RawFrame *frame) {
+	int width = Orientation % 180 == 0 ? frame->width : frame->height;
+	int height = Orientation % 180 == 0 ? frame->height : frame->width;
+	return copy_yuv_with_rotation(converter->bufAllocator, (uint8_t *)frame->planes[0].data, (uint8_t *)frame->planes[1].data,
+		(uint8_t *)frame->planes[2].data, Orientation, width, height, frame->planes[0].rowStride, frame->planes[1].rowStride, frame->planes[2].rowStride);
+}
+
+/* Chroma samples are interleaved, U then V (NV12) or V then U (NV21) */
+template <int Orientation, bool UFirst>
+static mblk_t *android_camera2_convert_yuv_semi_planar(const AndroidCamera2Converter *converter, const AndroidCamera2RawFrame *frame) {
+	int width = Orientation % 180 == 0 ? frame->width : frame->height;
+	int height = Orientation % 180 == 0 ? frame->height : frame->width;
+	return copy_ycbcrbiplanar_to_true_yuv_with_rotation_and_down_scale_by_2(converter->bufAllocator, frame->planes[0].data,
+		UFirst ? frame->planes[1].data : frame->planes[2].data, Orientation, width, height, frame->planes[0].rowStride, frame->planes[1].rowStride,
+		UFirst, FALSE);
+}
+
+/* Chroma planes interleaved with an unusual pixel stride, or apart with a pixel stride other than 1 */
+template <int Orientation>
+static mblk_t *android_camera2_convert_yuv_generic(const AndroidCamera2Converter *converter, const AndroidCamera2RawFrame *frame) {
+	MSPicture picture;
+	mblk_t *m = android_camera2_allocate_yuv(converter, Orientation, frame, &picture);
+	if (!m) return nullptr;
+
+	android_camera2_rotate_luma<Orientation>(frame, &picture);
+	for (int i = 1; i < 3; i++) {
+		android_camera2_rotate_plane<Orientation, 0>(frame->planes[i].data, frame->planes[i].rowStride, frame->planes[i].pixelStride,
+			frame->width / 2, frame->height / 2, picture.planes[i], picture.strides[i]);
+	}
+	return m;
+}
+
+typedef enum _AndroidCamera2ChromaLayout {
+	AndroidCamera2ChromaPlanar,
+	AndroidCamera2ChromaInterleavedUV,
+	AndroidCamera2ChromaInterleavedVU,
+	AndroidCamera2ChromaOther,
+	AndroidCamera2ChromaLayoutCount
+} AndroidCamera2ChromaLayout;
+
+#define ANDROID_CAMERA2_YUV_KERNELS(orientation) { \
+	&android_camera2_convert_yuv_planar<orientation>, \
+	&android_camera2_convert_yuv_semi_planar<orientation, true>, \
+	&android_camera2_convert_yuv_semi_planar<orientation, false>, \
+	&android_camera2_convert_yuv_generic<orientation> }
+
+// Indexed by orientation / 90 and chroma layout
+static const AndroidCamera2ConvertFunc android_camera2_yuv_kernels[4][AndroidCamera2ChromaLayoutCount] = {
+	ANDROID_CAMERA2_YUV_KERNELS(0), ANDROID_CAMERA2_YUV_KERNELS(90), ANDROID_CAMERA2_YUV_KERNELS(180), ANDROID_CAMERA2_YUV_KERNELS(270)
+};
+
+static AndroidCamera2ChromaLayout android_camera2_get_chroma_layout(const AndroidCamera2PlaneLayout *layout) {
+	if (layout->pixelStride[1] == 1 && layout->pixelStride[2] == 1) return AndroidCamera2ChromaPlanar;
+	if (layout->pixelStride[1] == 2 && layout->pixelStride[2] == 2 && layout->rowStride[1] == layout->rowStride[2]) {
+		if (layout->chromaOffset == 1) return AndroidCamera2ChromaInterleavedUV;
+		if (layout->chromaOffset == -1) return AndroidCamera2ChromaInterleavedVU;
+	}
+	return AndroidCamera2ChromaOther;
+}
+
+static const char *android_camera2_chroma_layout_to_string(AndroidCamera2ChromaLayout chromaLayout) {
+	switch (chromaLayout) {
+		case AndroidCamera2ChromaPlanar:
+			return "planar";
+		case AndroidCamera2ChromaInterleavedUV:
+			return "interleaved UV";
+		case AndroidCamera2ChromaInterleavedVU:
+			return "interleaved VU";
+		default:
+			break;
+	}
+	return "generic";
+}
+
+static const AndroidCamera2ConvertFunc android_camera2_luma_kernels[4] = {
+	&android_camera2_convert_luma<0>, &android_camera2_convert_luma<90>,
+	&android_camera2_convert_luma<180>, &android_camera2_convert_luma<270>
+};
+
+/* ************************************************************************* */
+
+void android_camera2_converter_init(AndroidCamera2Converter *converter, MSYuvBufAllocator *bufAllocator) {
+	memset(converter, 0, sizeof(*converter));
+	converter->bufAllocator = bufAllocator;
+	converter->lumaDecimation = 1;
+}
+
+void android_camera2_converter_set_plane_layout(AndroidCamera2Converter *converter, const AndroidCamera2RawFrame *frame) {
+	AndroidCamera2PlaneLayout *layout = &converter->layout;
+	layout->format = frame->format;
+	layout->width = frame->width;
+	layout->height = frame->height;
+	layout->planeCount = frame->planeCount;
+	for (int i = 0; i < frame->planeCount; i++) {
+		layout->length[i] = frame->planes[i].length;
+		layout->rowStride[i] = frame->planes[i].rowStride;
+		layout->pixelStride[i] = frame->planes[i].pixelStride;
+	}
+	layout->chromaOffset = frame->planeCount == 3 ? frame->planes[2].data - frame->planes[1].data : 0;
+	if (frame->planeCount == 3 && android_camera2_get_chroma_layout(layout) == AndroidCamera2ChromaOther) {
+		ms_warning("[Camera2 Capture] Chroma planes with pixel stride %d aren't interleaved, V is %lld bytes from U, using generic conversion",
+			frame->planes[1].pixelStride, (long long)layout->chromaOffset);
+	}
+	layout->valid = true;
+	converter->convert = nullptr;
+
+	ms_message("[Camera2 Capture] Plane layout is %dx%d format %d, strides %d/%d/%d, pixel strides %d/%d/%d", layout->width, layout->height, layout->format,
+		layout->rowStride[0], layout->rowStride[1], layout->rowStride[2], layout->pixelStride[0], layout->pixelStride[1], layout->pixelStride[2]);
+}
+
+bool android_camera2_converter_layout_matches(const AndroidCamera2Converter *converter, const AndroidCamera2RawFrame *frame) {
+	const AndroidCamera2PlaneLayout *layout = &converter->layout;
+	if (!layout->valid || frame->format != layout->format || frame->width != layout->width || frame->height != layout->height
+		|| frame->planeCount != layout->planeCount) return false;
+	for (int i = 0; i < frame->planeCount; i++) {
+		if (frame->planes[i].length != layout->length[i] || frame->planes[i].rowStride != layout->rowStride[i]
+			|| frame->planes[i].pixelStride != layout->pixelStride[i]) return false;
+	}
+	return frame->planeCount != 3 || frame->planes[2].data - frame->planes[1].data == layout->chromaOffset;
+}
+
+void android_camera2_converter_select_kernel(AndroidCamera2Converter *converter, int32_t orientation, bool gray8, int lumaDecimation) {
+	const AndroidCamera2PlaneLayout *layout = &converter->layout;
+	if (orientation % 90 != 0 || orientation < 0 || orientation >= 360) {
+		ms_error("[Camera2 Capture] Unsupported orientation %d, using 0", orientation);
+		orientation = 0;
+	}
+
+	converter->lumaDecimation = lumaDecimation;
+	if (gray8) {
+		converter->convert = android_camera2_luma_kernels[orientation / 90];
+	} else {
+		converter->convert = android_camera2_yuv_kernels[orientation / 90][android_camera2_get_chroma_layout(layout)];
+	}
+	ms_message("[Camera2 Capture] Conversion kernel selected for orientation %d, %s output, %s chroma", orientation,
+		gray8 ? "GRAY8" : "YUV420P", android_camera2_chroma_layout_to_string(android_camera2_get_chroma_layout(layout)));
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2010-2019 Belledonne Communications SARL.
+ *
+ * android-camera2-convert.h - Conversion of the raw frames of the Camera2 capture pipeline.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ANDROID_CAMERA2_CONVERT_H
+#define ANDROID_CAMERA2_CONVERT_H
+
+#include <mediastreamer2/msvideo.h>
+
+#include "android-camera2-dump.h"
+
+#include <stddef.h>
+
+/*
+ * Converts the frames delivered by the HAL, or read from a raw dump, to the YUV420P or GRAY8 frames sent by the filter.
+ * The plane layout is probed once and a kernel is selected for it, the orientation and the output format.
+ * This file doesn't depend on the camera NDK so dumps can be replayed through the conversion on a host as well.
+ */
+
+// Same value as AIMAGE_FORMAT_YUV_420_888, the only format converted
+#define ANDROID_CAMERA2_RAW_FORMAT_YUV_420_888 0x23
+
+struct AndroidCamera2Converter;
+
+typedef mblk_t *(*AndroidCamera2ConvertFunc)(const AndroidCamera2Converter *converter, const AndroidCamera2RawFrame *frame);
+
+// Layout of the images of an image reader, probed on the first one
+struct AndroidCamera2PlaneLayout {
+	bool valid;
+	int32_t format;
+	int32_t width;
+	int32_t height;
+	int32_t planeCount;
+	int32_t length[ANDROID_CAMERA2_RAW_FRAME_MAX_PLANES];
+	int32_t rowStride[ANDROID_CAMERA2_RAW_FRAME_MAX_PLANES];
+	int32_t pixelStride[ANDROID_CAMERA2_RAW_FRAME_MAX_PLANES];
+	ptrdiff_t chromaOffset; // V plane address minus U plane address
+};
+
+struct AndroidCamera2Converter {
+	AndroidCamera2PlaneLayout layout;
+	MSYuvBufAllocator *bufAllocator; // not owned
+	int lumaDecimation; // 1, 2 or 4, only used for GRAY8 output
+	AndroidCamera2ConvertFunc convert;
+};
+
+void android_camera2_converter_init(AndroidCamera2Converter *converter, MSYuvBufAllocator *bufAllocator);
+
+/* Probes the layout of a full frame, a kernel must be selected again before the next conversion */
+void android_camera2_converter_set_plane_layout(AndroidCamera2Converter *converter, const AndroidCamera2RawFrame *frame);
+/* Whether the frame has the probed layout, for frames that carry their whole layout like the ones of a dump */
+bool android_camera2_converter_layout_matches(const AndroidCamera2Converter *converter, const AndroidCamera2RawFrame *frame);
+
+/* Orientation is the clockwise rotation to apply, in degrees, gray8 outputs the decimated luma only */
+void android_camera2_converter_select_kernel(AndroidCamera2Converter *converter, int32_t orientation, bool gray8, int lumaDecimation);
+
+/* Frame must have the probed layout and a kernel must be selected */
+static inline mblk_t *android_camera2_converter_convert(const AndroidCamera2Converter *converter, const AndroidCamera2RawFrame *frame) {
+	return converter->convert(converter, frame);
+}
+
+#endif /* ANDROID_CAMERA2_CONVERT_H */
@@ -0,0 +1,302 @@
+/*
+ * Copyright (c) 2010-2019 Belledonne Communications SARL.
+ *
+ * android-camera2-dump.cpp - Raw frame dump and replay of the Camera2 capture pipeline.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "android-camera2-dump.h"
+
+#include <mediastreamer2/mscommon.h>
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define ANDROID_CAMERA2_DUMP_MAGIC "MSC2DUMP"
+#define ANDROID_CAMERA2_DUMP_VERSION 1
+// File is grown by this much each time the mapping is full, a 1080p NV12 frame is about 3MB
+#define ANDROID_CAMERA2_DUMP_GROW_SIZE (64 * 1024 * 1024)
+
+struct AndroidCamera2DumpFileHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t headerSize;
+};
+
+struct AndroidCamera2DumpRecordPlane {
+	int32_t offset; // from the start of the record data
+	int32_t length;
+	int32_t rowStride;
+	int32_t pixelStride;
+};
+
+// Every field is naturally aligned and records are padded to 8 bytes, so records can be read in place from the mapping
+struct AndroidCamera2DumpRecordHeader {
+	uint32_t size; // header and data, padding included
+	int32_t format;
+	int64_t timestamp;
+	int32_t width;
+	int32_t height;
+	int32_t planeCount;
+	int32_t reserved;
+	AndroidCamera2DumpRecordPlane planes[ANDROID_CAMERA2_RAW_FRAME_MAX_PLANES];
+};
+
+struct _AndroidCamera2DumpWriter {
+	int fd;
+	uint8_t *map;
+	size_t mapSize;
+	size_t size;
+	int frameCount;
+};
+
+struct _AndroidCamera2DumpReader {
+	int fd;
+	const uint8_t *map;
+	size_t size;
+	size_t position;
+	size_t firstRecord;
+};
+
+/* ************************************************************************* */
+
+static bool android_camera2_dump_writer_reserve(AndroidCamera2DumpWriter *writer, size_t needed) {
+	if (writer->map && writer->size + needed <= writer->mapSize) return true;
+
+	size_t mapSize = writer->mapSize;
+	while (mapSize < writer->size + needed) {
+		mapSize += ANDROID_CAMERA2_DUMP_GROW_SIZE;
+	}
+
+	if (writer->map) {
+		munmap(writer->map, writer->mapSize);
+		writer->map = nullptr;
+	}
+	if (ftruncate(writer->fd, (off_t)mapSize) != 0) {
+		ms_error("[Camera2 Capture] Couldn't grow raw dump to %zu bytes", mapSize);
+		return false;
+	}
+	void *map = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, writer->fd, 0);
+	if (map == MAP_FAILED) {
+		ms_error("[Camera2 Capture] Couldn't map raw dump of %zu bytes", mapSize);
+		return false;
+	}
+	writer->map = (uint8_t *)map;
+	writer->mapSize = mapSize;
+	return true;
+}
+
+AndroidCamera2DumpWriter *android_camera2_dump_writer_open(const char *path) {
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		ms_error("[Camera2 Capture] Couldn't open raw dump file %s", path);
+		return nullptr;
+	}
+
+	AndroidCamera2DumpWriter *writer = new AndroidCamera2DumpWriter();
+	writer->fd = fd;
+	writer->map = nullptr;
+	writer->mapSize = 0;
+	writer->size = 0;
+	writer->frameCount = 0;
+	if (!android_camera2_dump_writer_reserve(writer, sizeof(AndroidCamera2DumpFileHeader))) {
+		android_camera2_dump_writer_close(writer);
+		return nullptr;
+	}
+
+	AndroidCamera2DumpFileHeader header;
+	memcpy(header.magic, ANDROID_CAMERA2_DUMP_MAGIC, sizeof(header.magic));
+	header.version = ANDROID_CAMERA2_DUMP_VERSION;
+	header.headerSize = sizeof(header);
+	memcpy(writer->map, &header, sizeof(header));
+	writer->size = sizeof(header);
+
+	ms_message("[Camera2 Capture] Dumping raw frames to %s", path);
+	return writer;
+}
+
+/*
+ * Planes are stored by memory regions: planes overlapping each other, like the interleaved chroma planes
+ * of a semi-planar image, are written once and point into the same region.
+ */
+int android_camera2_dump_writer_append(AndroidCamera2DumpWriter *writer, const AndroidCamera2RawFrame *frame) {
+	AndroidCamera2DumpRecordHeader header;
+	memset(&header, 0, sizeof(header));
+	header.format = frame->format;
+	header.timestamp = frame->timestamp;
+	header.width = frame->width;
+	header.height = frame->height;
+	header.planeCount = frame->planeCount < ANDROID_CAMERA2_RAW_FRAME_MAX_PLANES ? frame->planeCount : ANDROID_CAMERA2_RAW_FRAME_MAX_PLANES;
+
+	// Sort planes by address, then merge the overlapping ones into regions
+	int order[ANDROID_CAMERA2_RAW_FRAME_MAX_PLANES];
+	for (int i = 0; i < header.planeCount; i++) {
+		int j = i;
+		while (j > 0 && frame->planes[order[j - 1]].data > frame->planes[i].data) {
+			order[j] = order[j - 1];
+			j--;
+		}
+		order[j] = i;
+	}
+
+	const uint8_t *regionStart[ANDROID_CAMERA2_RAW_FRAME_MAX_PLANES];
+	const uint8_t *regionEnd[ANDROID_CAMERA2_RAW_FRAME_MAX_PLANES];
+	int32_t regionOffset[ANDROID_CAMERA2_RAW_FRAME_MAX_PLANES];
+	int planeRegion[ANDROID_CAMERA2_RAW_FRAME_MAX_PLANES];
+	int regionCount = 0;
+	for (int i = 0; i < header.planeCount; i++) {
+		const AndroidCamera2RawPlane *plane = &frame->planes[order[i]];
+		if (regionCount > 0 && plane->data < regionEnd[regionCount - 1]) {
+			if (plane->data + plane->length > regionEnd[regionCount - 1]) regionEnd[regionCount - 1] = plane->data + plane->length;
+		} else {
+			regionStart[regionCount] = plane->data;
+			regionEnd[regionCount] = plane->data + plane->length;
+			regionCount++;
+		}
+		planeRegion[order[i]] = regionCount - 1;
+	}
+
+	size_t dataSize = 0;
+	for (int r = 0; r < regionCount; r++) {
+		regionOffset[r] = (int32_t)dataSize;
+		dataSize += regionEnd[r] - regionStart[r];
+	}
+	for (int i = 0; i < header.planeCount; i++) {
+		const AndroidCamera2RawPlane *plane = &frame->planes[i];
+		int r = planeRegion[i];
+		header.planes[i].offset = regionOffset[r] + (int32_t)(plane->data - regionStart[r]);
+		header.planes[i].length = plane->length;
+		header.planes[i].rowStride = plane->rowStride;
+		header.planes[i].pixelStride = plane->pixelStride;
+	}
+
+	size_t recordSize = (sizeof(header) + dataSize + 7) & ~(size_t)7;
+	if (!android_camera2_dump_writer_reserve(writer, recordSize)) return -1;
+
+	header.size = (uint32_t)recordSize;
+	uint8_t *dst = writer->map + writer->size;
+	memcpy(dst, &header, sizeof(header));
+	dst += sizeof(header);
+	for (int r = 0; r < regionCount; r++) {
+		memcpy(dst, regionStart[r], regionEnd[r] - regionStart[r]);
+		dst += regionEnd[r] - regionStart[r];
+	}
+	writer->size += recordSize;
+	writer->frameCount++;
+	return 0;
+}
+
+int android_camera2_dump_writer_close(AndroidCamera2DumpWriter *writer) {
+	int frameCount = writer->frameCount;
+	if (writer->map) munmap(writer->map, writer->mapSize);
+	// Drop the unused part of the last reservation
+	if (ftruncate(writer->fd, (off_t)writer->size) != 0) {
+		ms_error("[Camera2 Capture] Couldn't truncate raw dump to %zu bytes", writer->size);
+	}
+	close(writer->fd);
+	delete writer;
+
+	ms_message("[Camera2 Capture] Raw dump closed, %d frames written", frameCount);
+	return frameCount;
+}
+
+/* ************************************************************************* */
+
+AndroidCamera2DumpReader *android_camera2_dump_reader_open(const char *path) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		ms_error("[Camera2 Capture] Couldn't open raw dump file %s", path);
+		return nullptr;
+	}
+
+	struct stat st;
+	AndroidCamera2DumpFileHeader header;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(header)) {
+		ms_error("[Camera2 Capture] Raw dump file %s is too small", path);
+		close(fd);
+		return nullptr;
+	}
+
+	void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		ms_error("[Camera2 Capture] Couldn't map raw dump file %s", path);
+		close(fd);
+		return nullptr;
+	}
+
+	memcpy(&header, map, sizeof(header));
+	if (memcmp(header.magic, ANDROID_CAMERA2_DUMP_MAGIC, sizeof(header.magic)) != 0 || header.version != ANDROID_CAMERA2_DUMP_VERSION
+		|| header.headerSize < sizeof(header) || header.headerSize > (size_t)st.st_size) {
+		ms_error("[Camera2 Capture] %s isn't a raw dump file or its version isn't supported", path);
+		munmap(map, (size_t)st.st_size);
+		close(fd);
+		return nullptr;
+	}
+
+	AndroidCamera2DumpReader *reader = new AndroidCamera2DumpReader();
+	reader->fd = fd;
+	reader->map = (const uint8_t *)map;
+	reader->size = (size_t)st.st_size;
+	reader->firstRecord = header.headerSize;
+	reader->position = header.headerSize;
+	return reader;
+}
+
+bool android_camera2_dump_reader_next(AndroidCamera2DumpReader *reader, AndroidCamera2RawFrame *frame) {
+	AndroidCamera2DumpRecordHeader header;
+	if (reader->size - reader->position < sizeof(header)) return false;
+
+	memcpy(&header, reader->map + reader->position, sizeof(header));
+	if (header.size < sizeof(header) || header.size > reader->size - reader->position
+		|| header.planeCount < 0 || header.planeCount > ANDROID_CAMERA2_RAW_FRAME_MAX_PLANES) {
+		ms_error("[Camera2 Capture] Raw dump is corrupted at offset %zu", reader->position);
+		return false;
+	}
+
+	const uint8_t *data = reader->map + reader->position + sizeof(header);
+	size_t dataSize = header.size - sizeof(header);
+	for (int i = 0; i < header.planeCount; i++) {
+		const AndroidCamera2DumpRecordPlane *plane = &header.planes[i];
+		if (plane->offset < 0 || plane->length < 0 || (size_t)plane->offset + plane->length > dataSize) {
+			ms_error("[Camera2 Capture] Raw dump plane %d is out of its record at offset %zu", i, reader->position);
+			return false;
+		}
+		frame->planes[i].data = data + plane->offset;
+		frame->planes[i].length = plane->length;
+		frame->planes[i].rowStride = plane->rowStride;
+		frame->planes[i].pixelStride = plane->pixelStride;
+	}
+	frame->timestamp = header.timestamp;
+	frame->format = header.format;
+	frame->width = header.width;
+	frame->height = header.height;
+	frame->planeCount = header.planeCount;
+
+	reader->position += header.size;
+	return true;
+}
+
+void android_camera2_dump_reader_rewind(AndroidCamera2DumpReader *reader) {
+	reader->position = reader->firstRecord;
+}
+
+void android_camera2_dump_reader_close(AndroidCamera2DumpReader *reader) {
+	munmap((void *)reader->map, reader->size);
+	close(reader->fd);
+	delete reader;
+}
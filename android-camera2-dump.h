@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2010-2019 Belledonne Communications SARL.
+ *
+ * android-camera2-dump.h - Raw frame dump and replay of the Camera2 capture pipeline.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ANDROID_CAMERA2_DUMP_H
+#define ANDROID_CAMERA2_DUMP_H
+
+#include <stdint.h>
+
+/*
+ * A dump is an append-only file of the images delivered by the HAL, with their plane layout and timestamp, written through
+ * a memory mapping to keep the image callback cheap. Planes sharing memory (interleaved chroma) are stored once, so the
+ * layout seen by the conversion on replay is the one the HAL produced.
+ * This file doesn't depend on the camera NDK so dumps can be read on a host as well.
+ *
+ * File layout, native endianness:
+ *   file header: "MSC2DUMP", uint32 version, uint32 file header size
+ *   records: uint32 record size (header and data), then the fields of AndroidCamera2RawFrame, planes are given by
+ *   their offset from the start of the record data, then the data
+ */
+
+#define ANDROID_CAMERA2_RAW_FRAME_MAX_PLANES 3
+
+typedef struct _AndroidCamera2RawPlane {
+	const uint8_t *data;
+	int32_t length;
+	int32_t rowStride;
+	int32_t pixelStride;
+} AndroidCamera2RawPlane;
+
+typedef struct _AndroidCamera2RawFrame {
+	int64_t timestamp; // ns, sensor timestamp
+	int32_t format; // AIMAGE_FORMAT_*
+	int32_t width;
+	int32_t height;
+	int32_t planeCount;
+	AndroidCamera2RawPlane planes[ANDROID_CAMERA2_RAW_FRAME_MAX_PLANES];
+} AndroidCamera2RawFrame;
+
+typedef struct _AndroidCamera2DumpWriter AndroidCamera2DumpWriter;
+typedef struct _AndroidCamera2DumpReader AndroidCamera2DumpReader;
+
+AndroidCamera2DumpWriter *android_camera2_dump_writer_open(const char *path);
+/* Not thread safe, returns 0 on success */
+int android_camera2_dump_writer_append(AndroidCamera2DumpWriter *writer, const AndroidCamera2RawFrame *frame);
+/* Returns the number of frames written */
+int android_camera2_dump_writer_close(AndroidCamera2DumpWriter *writer);
+
+AndroidCamera2DumpReader *android_camera2_dump_reader_open(const char *path);
+/* Planes of the frame point into the dump and are valid until the reader is closed, returns false at the end of the dump */
+bool android_camera2_dump_reader_next(AndroidCamera2DumpReader *reader, AndroidCamera2RawFrame *frame);
+void android_camera2_dump_reader_rewind(AndroidCamera2DumpReader *reader);
+void android_camera2_dump_reader_close(AndroidCamera2DumpReader *reader);
+
+#endif /* ANDROID_CAMERA2_DUMP_H */
@@ -0,0 +1,661 @@
+/*
+ * Copyright (c) 2010-2019 Belledonne Communications SARL.
+ *
+ * android-camera2-replay.cpp - Host replay of raw dumps through the Camera2 capture conversion.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "android-camera2-convert.h"
+#include "android-camera2-dump.h"
+#include "android-camera2-trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <vector>
+
+/*
+ * Feeds the frames of a raw dump recorded with MS_ANDROID_CAMERA2_CAPTURE_SET_RAW_DUMP to the conversion used by the filter,
+ * to measure and check it without a device:
+ *   msandroidcamera2-replay [--orientation 0|90|180|270] [--gray8] [--decimation 1|2|4] [--loop passes] [--output file] [--trace file]
+ *                           [--emit-latency interval] dump
+ * --trace records the conversions like the filter does and writes them in the Chrome trace JSON format.
+ * --emit-latency runs the frames of the dump, at their sensor timestamps and with their measured conversion time, through
+ * a simulation of a ticker of the given interval in ms, polled and in push mode, and gives the capture to emit latency.
+ * --self-test writes a dump of synthetic frames in every supported layout and checks the conversion of each of them, also
+ * against copy_yuv_with_rotation() of mediastreamer2, and the trace of these conversions. It also runs the ticker simulation on a synthetic 30 fps timeline.
+ */
+
+static uint64_t android_camera2_replay_get_time_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void android_camera2_replay_usage(const char *program) {
+	fprintf(stderr, "Usage: %s [--orientation 0|90|180|270] [--gray8] [--decimation 1|2|4] [--loop passes] [--output file] [--trace file]\n", program);
+	fprintf(stderr, "       [--emit-latency interval] dump\n");
+	fprintf(stderr, "       %s --self-test\n", program);
+}
+
+/* ************************************************************************* */
+
+// Sensor and ticker clocks are unrelated, the simulation is run with the ticks at several offsets from the first capture
+#define ANDROID_CAMERA2_REPLAY_EMIT_PHASES 10
+
+typedef struct _AndroidCamera2ReplayEmitLatency {
+	int emittedFrames;
+	int droppedFrames; // replaced by the next frame before a tick emitted them
+	float averageLatency; // ms
+	float maxLatency; // ms
+} AndroidCamera2ReplayEmitLatency;
+
+/*
+ * Runs frames captured and ready to emit at the given times, in us, through a ticker starting at phase and ticking every
+ * interval. Polled, a frame is emitted by the first tick due after it is ready. In push mode the ticks follow
+ * android_camera2_capture_wait_next_tick(): a tick runs as soon as a frame is ready if it is due within one interval,
+ * never earlier. The time spent in the graph itself isn't simulated. Accumulates into latency.
+ */
+static void android_camera2_replay_simulate_emit(const int64_t *captureTimes, const int64_t *readyTimes, int count, int64_t interval, int64_t phase,
+	bool push, AndroidCamera2ReplayEmitLatency *latency, double *totalLatency) {
+	// Ticker already running when the first frame is captured
+	int64_t virtualTime = captureTimes[0] + phase - interval;
+	int64_t tickTime = virtualTime;
+	int next = 0;
+	int pending = -1;
+
+	while (true) {
+		while (next < count && readyTimes[next] <= tickTime) {
+			if (pending >= 0) latency->droppedFrames++;
+			pending = next++;
+		}
+		if (pending >= 0) {
+			float frameLatency = (tickTime - captureTimes[pending]) / 1000.f;
+			*totalLatency += frameLatency;
+			if (frameLatency > latency->maxLatency) latency->maxLatency = frameLatency;
+			latency->emittedFrames++;
+			pending = -1;
+		} else if (next >= count) {
+			break;
+		}
+
+		int64_t nextVirtualTime = virtualTime + interval;
+		if (push && next < count) {
+			int64_t wakeTime = readyTimes[next] > virtualTime ? readyTimes[next] : virtualTime;
+			tickTime = wakeTime < nextVirtualTime ? wakeTime : nextVirtualTime;
+		} else {
+			tickTime = nextVirtualTime;
+		}
+		virtualTime = nextVirtualTime;
+	}
+}
+
+static void android_camera2_replay_measure_emit_latency(const int64_t *captureTimes, const int64_t *readyTimes, int count, int interval, bool push,
+	AndroidCamera2ReplayEmitLatency *latency) {
+	double totalLatency = 0;
+	memset(latency, 0, sizeof(*latency));
+	for (int phase = 0; phase < ANDROID_CAMERA2_REPLAY_EMIT_PHASES; phase++) {
+		android_camera2_replay_simulate_emit(captureTimes, readyTimes, count, interval * 1000LL, (int64_t)phase * interval * 1000 / ANDROID_CAMERA2_REPLAY_EMIT_PHASES,
+			push, latency, &totalLatency);
+	}
+	if (latency->emittedFrames > 0) latency->averageLatency = (float)(totalLatency / latency->emittedFrames);
+}
+
+static void android_camera2_replay_print_emit_latency(const int64_t *captureTimes, const int64_t *readyTimes, int count, int interval) {
+	AndroidCamera2ReplayEmitLatency polled;
+	AndroidCamera2ReplayEmitLatency pushed;
+	android_camera2_replay_measure_emit_latency(captureTimes, readyTimes, count, interval, false, &polled);
+	android_camera2_replay_measure_emit_latency(captureTimes, readyTimes, count, interval, true, &pushed);
+	printf("Emit latency of %d frames on a %d ms ticker, %d tick phases, from capture to emit, HAL delivery not included:\n", count, interval,
+		ANDROID_CAMERA2_REPLAY_EMIT_PHASES);
+	printf("  polling: %.2f ms on average, %.2f ms at most, %d frames dropped\n", polled.averageLatency, polled.maxLatency, polled.droppedFrames);
+	printf("  push:    %.2f ms on average, %.2f ms at most, %d frames dropped\n", pushed.averageLatency, pushed.maxLatency, pushed.droppedFrames);
+}
+
+/* ************************************************************************* */
+
+static int android_camera2_replay_dump(const char *path, int orientation, bool gray8, int decimation, int passes, const char *outputPath, const char *tracePath,
+	int emitInterval) {
+	AndroidCamera2DumpReader *reader = android_camera2_dump_reader_open(path);
+	if (!reader) {
+		fprintf(stderr, "Couldn't open raw dump %s\n", path);
+		return 1;
+	}
+	FILE *output = nullptr;
+	if (outputPath) {
+		output = fopen(outputPath, "wb");
+		if (!output) {
+			fprintf(stderr, "Couldn't open output file %s\n", outputPath);
+			android_camera2_dump_reader_close(reader);
+			return 1;
+		}
+	}
+
+	if (tracePath) android_camera2_trace_set_flags(ANDROID_CAMERA2_TRACE_RECORD);
+
+	MSYuvBufAllocator *bufAllocator = ms_yuv_buf_allocator_new();
+	AndroidCamera2Converter converter;
+	android_camera2_converter_init(&converter, bufAllocator);
+
+	AndroidCamera2RawFrame frame;
+	int convertedFrames = 0;
+	int skippedFrames = 0;
+	uint64_t conversionTime = 0;
+	uint64_t maxConversionTime = 0;
+	std::vector<int64_t> captureTimes;
+	std::vector<int64_t> readyTimes;
+	for (int pass = 0; pass < passes; pass++) {
+		int passFrames = 0;
+		android_camera2_dump_reader_rewind(reader);
+		while (android_camera2_dump_reader_next(reader, &frame)) {
+			if (frame.format != ANDROID_CAMERA2_RAW_FORMAT_YUV_420_888 || frame.planeCount != 3) {
+				skippedFrames++;
+				continue;
+			}
+			if (!android_camera2_converter_layout_matches(&converter, &frame)) {
+				android_camera2_converter_set_plane_layout(&converter, &frame);
+				android_camera2_converter_select_kernel(&converter, orientation, gray8, decimation);
+			}
+
+			uint64_t start = android_camera2_replay_get_time_us();
+			android_camera2_trace_begin(AndroidCamera2TraceConvert);
+			mblk_t *m = android_camera2_converter_convert(&converter, &frame);
+			android_camera2_trace_end(AndroidCamera2TraceConvert);
+			uint64_t duration = android_camera2_replay_get_time_us() - start;
+			if (!m) {
+				fprintf(stderr, "Conversion of frame %d failed\n", convertedFrames);
+				continue;
+			}
+			conversionTime += duration;
+			if (duration > maxConversionTime) maxConversionTime = duration;
+			convertedFrames++;
+			passFrames++;
+			if (output && pass == 0) {
+				fwrite(m->b_rptr, 1, m->b_wptr - m->b_rptr, output);
+			}
+			if (emitInterval > 0 && pass == 0) {
+				captureTimes.push_back(frame.timestamp / 1000);
+				readyTimes.push_back(frame.timestamp / 1000 + (int64_t)duration);
+			}
+			freemsg(m);
+		}
+		// Nothing will change on the next pass
+		if (passFrames == 0) break;
+	}
+
+	printf("%d frames converted, %d skipped", convertedFrames, skippedFrames);
+	if (convertedFrames > 0) {
+		printf(", %.1f us per frame on average, %llu us at most", (double)conversionTime / convertedFrames, (unsigned long long)maxConversionTime);
+	}
+	printf("\n");
+	if (!captureTimes.empty()) {
+		android_camera2_replay_print_emit_latency(captureTimes.data(), readyTimes.data(), (int)captureTimes.size(), emitInterval);
+	}
+
+	int result = convertedFrames > 0 ? 0 : 1;
+	if (tracePath && android_camera2_trace_dump(tracePath) != 0) {
+		fprintf(stderr, "Couldn't write trace %s\n", tracePath);
+		result = 1;
+	}
+	if (output) fclose(output);
+	ms_yuv_buf_allocator_free(bufAllocator);
+	android_camera2_dump_reader_close(reader);
+	return result;
+}
+
+/* ************************************************************************* */
+
+// Not multiples of 8 so the ends of the rotated rows are covered too
+#define ANDROID_CAMERA2_REPLAY_TEST_WIDTH 76
+#define ANDROID_CAMERA2_REPLAY_TEST_HEIGHT 52
+// Rows are padded like the HAL does
+#define ANDROID_CAMERA2_REPLAY_TEST_STRIDE 88
+
+static uint8_t android_camera2_replay_test_sample(int plane, int row, int col) {
+	if (plane == 0) return (uint8_t)(col * 7 + row * 13);
+	if (plane == 1) return (uint8_t)(col * 3 + row * 5 + 50);
+	return (uint8_t)(col * 11 + row * 2 + 100);
+}
+
+typedef enum _AndroidCamera2ReplayTestLayout {
+	AndroidCamera2ReplayTestPlanar,
+	AndroidCamera2ReplayTestNV12,
+	AndroidCamera2ReplayTestNV21,
+	AndroidCamera2ReplayTestSplit, // chroma planes apart with a pixel stride of 2, goes through the generic kernel
+	AndroidCamera2ReplayTestLayoutCount
+} AndroidCamera2ReplayTestLayout;
+
+static const char *android_camera2_replay_test_layout_to_string(int layout) {
+	switch (layout) {
+		case AndroidCamera2ReplayTestPlanar:
+			return "planar";
+		case AndroidCamera2ReplayTestNV12:
+			return "NV12";
+		case AndroidCamera2ReplayTestNV21:
+			return "NV21";
+		case AndroidCamera2ReplayTestSplit:
+			return "split chroma";
+	}
+	return "unknown";
+}
+
+/* Buffer must hold the luma plane followed by the chroma planes, with ANDROID_CAMERA2_REPLAY_TEST_STRIDE rows */
+static void android_camera2_replay_test_fill_frame(AndroidCamera2RawFrame *frame, uint8_t *buffer, int layout, int64_t timestamp) {
+	const int width = ANDROID_CAMERA2_REPLAY_TEST_WIDTH;
+	const int height = ANDROID_CAMERA2_REPLAY_TEST_HEIGHT;
+	const int stride = ANDROID_CAMERA2_REPLAY_TEST_STRIDE;
+	uint8_t *y = buffer;
+	uint8_t *chroma = buffer + stride * height;
+
+	memset(buffer, 0xee, stride * height * 2);
+	for (int row = 0; row < height; row++) {
+		for (int col = 0; col < width; col++) y[row * stride + col] = android_camera2_replay_test_sample(0, row, col);
+	}
+
+	frame->timestamp = timestamp;
+	frame->format = ANDROID_CAMERA2_RAW_FORMAT_YUV_420_888;
+	frame->width = width;
+	frame->height = height;
+	frame->planeCount = 3;
+	frame->planes[0].data = y;
+	frame->planes[0].length = stride * (height - 1) + width;
+	frame->planes[0].rowStride = stride;
+	frame->planes[0].pixelStride = 1;
+
+	if (layout == AndroidCamera2ReplayTestPlanar) {
+		int uvStride = stride / 2;
+		uint8_t *u = chroma;
+		uint8_t *v = chroma + uvStride * height / 2;
+		for (int row = 0; row < height / 2; row++) {
+			for (int col = 0; col < width / 2; col++) {
+				u[row * uvStride + col] = android_camera2_replay_test_sample(1, row, col);
+				v[row * uvStride + col] = android_camera2_replay_test_sample(2, row, col);
+			}
+		}
+		for (int i = 1; i < 3; i++) {
+			frame->planes[i].data = i == 1 ? u : v;
+			frame->planes[i].length = uvStride * (height / 2 - 1) + width / 2;
+			frame->planes[i].rowStride = uvStride;
+			frame->planes[i].pixelStride = 1;
+		}
+	} else {
+		uint8_t *u = layout == AndroidCamera2ReplayTestNV21 ? chroma + 1 : chroma;
+		uint8_t *v = layout == AndroidCamera2ReplayTestNV12 ? chroma + 1 : layout == AndroidCamera2ReplayTestNV21 ? chroma : chroma + stride * height / 2;
+		for (int row = 0; row < height / 2; row++) {
+			for (int col = 0; col < width / 2; col++) {
+				u[row * stride + col * 2] = android_camera2_replay_test_sample(1, row, col);
+				v[row * stride + col * 2] = android_camera2_replay_test_sample(2, row, col);
+			}
+		}
+		for (int i = 1; i < 3; i++) {
+			frame->planes[i].data = i == 1 ? u : v;
+			frame->planes[i].length = stride * (height / 2 - 1) + width - 1;
+			frame->planes[i].rowStride = stride;
+			frame->planes[i].pixelStride = 2;
+		}
+	}
+}
+
+/* Clockwise rotation: position in the source plane of width x height of the sample at row, col of the rotated plane */
+static void android_camera2_replay_test_source_position(int orientation, int row, int col, int width, int height, int *srcRow, int *srcCol) {
+	switch (orientation) {
+		case 90:
+			*srcRow = height - 1 - col;
+			*srcCol = row;
+			break;
+		case 180:
+			*srcRow = height - 1 - row;
+			*srcCol = width - 1 - col;
+			break;
+		case 270:
+			*srcRow = col;
+			*srcCol = width - 1 - row;
+			break;
+		default:
+			*srcRow = row;
+			*srcCol = col;
+			break;
+	}
+}
+
+/* Returns the number of samples that differ from the expected ones */
+static int android_camera2_replay_test_check_plane(const uint8_t *data, int stride, int plane, int orientation, int srcWidth, int srcHeight, int decimation) {
+	int width = orientation % 180 == 0 ? srcWidth : srcHeight;
+	int height = orientation % 180 == 0 ? srcHeight : srcWidth;
+	int errors = 0;
+	for (int row = 0; row < height; row++) {
+		for (int col = 0; col < width; col++) {
+			int srcRow, srcCol;
+			android_camera2_replay_test_source_position(orientation, row, col, srcWidth, srcHeight, &srcRow, &srcCol);
+			if (data[row * stride + col] != android_camera2_replay_test_sample(plane, srcRow * decimation, srcCol * decimation)) errors++;
+		}
+	}
+	return errors;
+}
+
+static int android_camera2_replay_test_check_frame(mblk_t *m, int orientation, bool gray8, int decimation) {
+	const int width = ANDROID_CAMERA2_REPLAY_TEST_WIDTH;
+	const int height = ANDROID_CAMERA2_REPLAY_TEST_HEIGHT;
+	int dstWidth = orientation % 180 == 0 ? width : height;
+	int dstHeight = orientation % 180 == 0 ? height : width;
+
+	if (gray8) {
+		int lumaWidth = dstWidth / decimation;
+		if (m->b_wptr - m->b_rptr != lumaWidth * (dstHeight / decimation)) return -1;
+		return android_camera2_replay_test_check_plane(m->b_rptr, lumaWidth, 0, orientation, width / decimation, height / decimation, decimation);
+	}
+
+	MSPicture picture;
+	if (ms_yuv_buf_init_from_mblk_with_size(&picture, m, dstWidth, dstHeight) != 0) return -1;
+	int errors = android_camera2_replay_test_check_plane(picture.planes[0], picture.strides[0], 0, orientation, width, height, 1);
+	errors += android_camera2_replay_test_check_plane(picture.planes[1], picture.strides[1], 1, orientation, width / 2, height / 2, 1);
+	errors += android_camera2_replay_test_check_plane(picture.planes[2], picture.strides[2], 2, orientation, width / 2, height / 2, 1);
+	return errors;
+}
+
+/*
+ * The frame as mediastreamer2 rotates it, to check that the conversion follows its orientation convention: chroma planes
+ * are first copied apart with a pixel stride of 1, the layout copy_yuv_with_rotation() takes.
+ */
+static mblk_t *android_camera2_replay_test_reference(MSYuvBufAllocator *bufAllocator, const AndroidCamera2RawFrame *frame, int orientation) {
+	int chromaWidth = frame->width / 2;
+	int chromaHeight = frame->height / 2;
+	uint8_t *chroma[2];
+	for (int i = 0; i < 2; i++) {
+		const AndroidCamera2RawPlane *plane = &frame->planes[i + 1];
+		chroma[i] = (uint8_t *)ms_malloc(chromaWidth * chromaHeight);
+		for (int row = 0; row < chromaHeight; row++) {
+			for (int col = 0; col < chromaWidth; col++) chroma[i][row * chromaWidth + col] = plane->data[row * plane->rowStride + col * plane->pixelStride];
+		}
+	}
+	int width = orientation % 180 == 0 ? frame->width : frame->height;
+	int height = orientation % 180 == 0 ? frame->height : frame->width;
+	mblk_t *m = copy_yuv_with_rotation(bufAllocator, (uint8_t *)frame->planes[0].data, chroma[0], chroma[1], orientation, width, height,
+		frame->planes[0].rowStride, chromaWidth, chromaWidth);
+	ms_free(chroma[0]);
+	ms_free(chroma[1]);
+	return m;
+}
+
+/* Returns the number of samples of the conversion that differ from the reference, the luma plane only for GRAY8 */
+static int android_camera2_replay_test_compare(mblk_t *m, mblk_t *reference, int orientation, bool gray8) {
+	int width = orientation % 180 == 0 ? ANDROID_CAMERA2_REPLAY_TEST_WIDTH : ANDROID_CAMERA2_REPLAY_TEST_HEIGHT;
+	int height = orientation % 180 == 0 ? ANDROID_CAMERA2_REPLAY_TEST_HEIGHT : ANDROID_CAMERA2_REPLAY_TEST_WIDTH;
+	MSPicture expected;
+	MSPicture picture;
+	if (ms_yuv_buf_init_from_mblk_with_size(&expected, reference, width, height) != 0) return -1;
+	if (gray8) {
+		if (m->b_wptr - m->b_rptr != width * height) return -1;
+		picture.planes[0] = m->b_rptr;
+		picture.strides[0] = width;
+	} else if (ms_yuv_buf_init_from_mblk_with_size(&picture, m, width, height) != 0) {
+		return -1;
+	}
+
+	int errors = 0;
+	for (int plane = 0; plane < (gray8 ? 1 : 3); plane++) {
+		int planeWidth = plane == 0 ? width : width / 2;
+		int planeHeight = plane == 0 ? height : height / 2;
+		for (int row = 0; row < planeHeight; row++) {
+			for (int col = 0; col < planeWidth; col++) {
+				if (picture.planes[plane][row * picture.strides[plane] + col] != expected.planes[plane][row * expected.strides[plane] + col]) errors++;
+			}
+		}
+	}
+	return errors;
+}
+
+static int android_camera2_replay_test_count(const char *text, const char *pattern) {
+	int count = 0;
+	for (const char *found = strstr(text, pattern); found; found = strstr(found + 1, pattern)) count++;
+	return count;
+}
+
+/*
+ * Checks the trace of the self-test conversions: a JSON document with one begin and one end for each of them. Sections
+ * whose tracing flags change between their begin and their end must stay balanced too. Returns the number of failures.
+ */
+static int android_camera2_replay_test_check_trace(int conversions) {
+	// Begins untraced, ends traced: nothing recorded. Begins traced, ends untraced: both recorded.
+	android_camera2_trace_set_flags(0);
+	android_camera2_trace_begin(AndroidCamera2TraceStop);
+	android_camera2_trace_set_flags(ANDROID_CAMERA2_TRACE_RECORD);
+	android_camera2_trace_end(AndroidCamera2TraceStop);
+	android_camera2_trace_begin(AndroidCamera2TraceHandoff);
+	android_camera2_trace_set_flags(0);
+	android_camera2_trace_end(AndroidCamera2TraceHandoff);
+
+	char path[] = "/tmp/msandroidcamera2-trace-XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		fprintf(stderr, "Couldn't create temporary trace\n");
+		return 1;
+	}
+	close(fd);
+	if (android_camera2_trace_dump(path) != 0) {
+		unlink(path);
+		return 1;
+	}
+	FILE *file = fopen(path, "rb");
+	unlink(path);
+	if (!file) return 1;
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	char *text = (char *)ms_malloc(size + 1);
+	size_t length = fread(text, 1, size, file);
+	text[length] = '\0';
+	fclose(file);
+
+	static const char *header = "{\"traceEvents\":[";
+	static const char *footer = "\n],\"displayTimeUnit\":\"ms\"}\n";
+	struct {
+		const char *pattern;
+		int expected;
+	} sections[] = {
+		{ "{\"name\":\"convert\",\"cat\":\"camera2\",\"ph\":\"B\"", conversions },
+		{ "{\"name\":\"convert\",\"cat\":\"camera2\",\"ph\":\"E\"", conversions },
+		{ "{\"name\":\"handoff\",\"cat\":\"camera2\",\"ph\":\"B\"", 1 },
+		{ "{\"name\":\"handoff\",\"cat\":\"camera2\",\"ph\":\"E\"", 1 },
+		{ "{\"name\":\"stop\"", 0 }
+	};
+	int failures = 0;
+	if (strncmp(text, header, strlen(header)) != 0 || length < strlen(footer) || strcmp(text + length - strlen(footer), footer) != 0) {
+		fprintf(stderr, "FAILED: trace isn't a Chrome trace JSON document\n");
+		failures++;
+	}
+	for (const auto &section : sections) {
+		int count = android_camera2_replay_test_count(text, section.pattern);
+		if (count != section.expected) {
+			fprintf(stderr, "FAILED: %d trace events %s..., expected %d\n", count, section.pattern, section.expected);
+			failures++;
+		}
+	}
+	ms_free(text);
+	return failures;
+}
+
+#define ANDROID_CAMERA2_REPLAY_TEST_EMIT_FRAMES 300
+#define ANDROID_CAMERA2_REPLAY_TEST_EMIT_INTERVAL 10 // ms, the default ticker interval of mediastreamer2
+
+/*
+ * A 30 fps sensor whose frames take 2 to 5 ms to be converted. Polled, they wait for the next tick. In push mode they are
+ * emitted when converted, ticks are due every 10 ms so none is more than one interval ahead. Returns the number of failures.
+ */
+static int android_camera2_replay_test_emit_latency(void) {
+	int64_t captureTimes[ANDROID_CAMERA2_REPLAY_TEST_EMIT_FRAMES];
+	int64_t readyTimes[ANDROID_CAMERA2_REPLAY_TEST_EMIT_FRAMES];
+	int64_t maxConversionTime = 0;
+	for (int i = 0; i < ANDROID_CAMERA2_REPLAY_TEST_EMIT_FRAMES; i++) {
+		int64_t conversionTime = 2000 + (i * 7919) % 3000;
+		captureTimes[i] = 1000000 + (int64_t)i * 1000000 / 30;
+		readyTimes[i] = captureTimes[i] + conversionTime;
+		if (conversionTime > maxConversionTime) maxConversionTime = conversionTime;
+	}
+
+	AndroidCamera2ReplayEmitLatency polled;
+	AndroidCamera2ReplayEmitLatency pushed;
+	android_camera2_replay_measure_emit_latency(captureTimes, readyTimes, ANDROID_CAMERA2_REPLAY_TEST_EMIT_FRAMES, ANDROID_CAMERA2_REPLAY_TEST_EMIT_INTERVAL, false, &polled);
+	android_camera2_replay_measure_emit_latency(captureTimes, readyTimes, ANDROID_CAMERA2_REPLAY_TEST_EMIT_FRAMES, ANDROID_CAMERA2_REPLAY_TEST_EMIT_INTERVAL, true, &pushed);
+	android_camera2_replay_print_emit_latency(captureTimes, readyTimes, ANDROID_CAMERA2_REPLAY_TEST_EMIT_FRAMES, ANDROID_CAMERA2_REPLAY_TEST_EMIT_INTERVAL);
+
+	int failures = 0;
+	int expectedFrames = ANDROID_CAMERA2_REPLAY_TEST_EMIT_FRAMES * ANDROID_CAMERA2_REPLAY_EMIT_PHASES;
+	if (polled.emittedFrames != expectedFrames || pushed.emittedFrames != expectedFrames || polled.droppedFrames != 0 || pushed.droppedFrames != 0) {
+		fprintf(stderr, "FAILED: emit simulation lost frames, %d polled and %d pushed out of %d\n", polled.emittedFrames, pushed.emittedFrames, expectedFrames);
+		failures++;
+	}
+	if (pushed.maxLatency > maxConversionTime / 1000.f) {
+		fprintf(stderr, "FAILED: a pushed frame waited for a tick, %.2f ms for at most %.2f ms of conversion\n", pushed.maxLatency, maxConversionTime / 1000.f);
+		failures++;
+	}
+	if (polled.maxLatency > maxConversionTime / 1000.f + ANDROID_CAMERA2_REPLAY_TEST_EMIT_INTERVAL || polled.averageLatency <= pushed.averageLatency) {
+		fprintf(stderr, "FAILED: polled frames waited %.2f ms on average and %.2f ms at most\n", polled.averageLatency, polled.maxLatency);
+		failures++;
+	}
+	return failures;
+}
+
+/* Goes through a dump too, to check that a frame read back has the layout the HAL produced */
+static int android_camera2_replay_self_test(void) {
+	char path[] = "/tmp/msandroidcamera2-replay-XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		fprintf(stderr, "Couldn't create temporary dump\n");
+		return 1;
+	}
+	close(fd);
+
+	AndroidCamera2DumpWriter *writer = android_camera2_dump_writer_open(path);
+	if (!writer) {
+		unlink(path);
+		return 1;
+	}
+	uint8_t *buffer = (uint8_t *)ms_malloc(ANDROID_CAMERA2_REPLAY_TEST_STRIDE * ANDROID_CAMERA2_REPLAY_TEST_HEIGHT * 2);
+	for (int layout = 0; layout < AndroidCamera2ReplayTestLayoutCount; layout++) {
+		AndroidCamera2RawFrame frame;
+		android_camera2_replay_test_fill_frame(&frame, buffer, layout, (int64_t)layout * 33333333);
+		android_camera2_dump_writer_append(writer, &frame);
+	}
+	ms_free(buffer);
+	android_camera2_dump_writer_close(writer);
+
+	AndroidCamera2DumpReader *reader = android_camera2_dump_reader_open(path);
+	unlink(path);
+	if (!reader) return 1;
+
+	MSYuvBufAllocator *bufAllocator = ms_yuv_buf_allocator_new();
+	AndroidCamera2Converter converter;
+	android_camera2_converter_init(&converter, bufAllocator);
+	static const int decimations[] = { 0, 1, 2, 4 }; // 0 for YUV420P output
+	int failures = 0;
+	int checks = 0;
+	int parityFailures = 0;
+	int parityChecks = 0;
+	android_camera2_trace_set_flags(ANDROID_CAMERA2_TRACE_RECORD);
+
+	AndroidCamera2RawFrame frame;
+	for (int layout = 0; android_camera2_dump_reader_next(reader, &frame); layout++) {
+		android_camera2_converter_set_plane_layout(&converter, &frame);
+		for (int orientation = 0; orientation < 360; orientation += 90) {
+			for (int decimation : decimations) {
+				bool gray8 = decimation != 0;
+				android_camera2_converter_select_kernel(&converter, orientation, gray8, gray8 ? decimation : 1);
+				android_camera2_trace_begin(AndroidCamera2TraceConvert);
+				mblk_t *m = android_camera2_converter_convert(&converter, &frame);
+				android_camera2_trace_end(AndroidCamera2TraceConvert);
+				int errors = m ? android_camera2_replay_test_check_frame(m, orientation, gray8, gray8 ? decimation : 1) : -1;
+				checks++;
+				if (errors != 0) {
+					failures++;
+					fprintf(stderr, "FAILED: %s frame, orientation %d, %s output%s: %d wrong samples\n", android_camera2_replay_test_layout_to_string(layout),
+						orientation, gray8 ? "GRAY8" : "YUV420P", gray8 ? (decimation == 1 ? "" : " decimated") : "", errors);
+				}
+				if (m && decimation <= 1) {
+					mblk_t *reference = android_camera2_replay_test_reference(bufAllocator, &frame, orientation);
+					errors = reference ? android_camera2_replay_test_compare(m, reference, orientation, gray8) : -1;
+					if (reference) freemsg(reference);
+					parityChecks++;
+					if (errors != 0) {
+						parityFailures++;
+						fprintf(stderr, "FAILED: %s frame, orientation %d, %s output differs from copy_yuv_with_rotation: %d samples\n",
+							android_camera2_replay_test_layout_to_string(layout), orientation, gray8 ? "GRAY8" : "YUV420P", errors);
+					}
+				}
+				if (m) freemsg(m);
+			}
+		}
+	}
+
+	ms_yuv_buf_allocator_free(bufAllocator);
+	android_camera2_dump_reader_close(reader);
+	printf("%d/%d conversions checked successfully\n", checks - failures, checks);
+	printf("%d/%d conversions match copy_yuv_with_rotation\n", parityChecks - parityFailures, parityChecks);
+
+	int traceFailures = android_camera2_replay_test_check_trace(checks);
+	printf("Trace of the conversions %s\n", traceFailures == 0 ? "checked successfully" : "FAILED");
+
+	int emitFailures = android_camera2_replay_test_emit_latency();
+	printf("Ticker simulation %s\n", emitFailures == 0 ? "checked successfully" : "FAILED");
+	return failures == 0 && parityFailures == 0 && traceFailures == 0 && emitFailures == 0 && checks == AndroidCamera2ReplayTestLayoutCount * 16
+		&& parityChecks == AndroidCamera2ReplayTestLayoutCount * 8 ? 0 : 1;
+}
+
+/* ************************************************************************* */
+
+int main(int argc, char *argv[]) {
+	int orientation = 0;
+	bool gray8 = false;
+	int decimation = 1;
+	int passes = 1;
+	const char *outputPath = nullptr;
+	const char *tracePath = nullptr;
+	int emitInterval = 0;
+	const char *path = nullptr;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--self-test") == 0) {
+			return android_camera2_replay_self_test();
+		} else if (strcmp(argv[i], "--gray8") == 0) {
+			gray8 = true;
+		} else if (strcmp(argv[i], "--orientation") == 0 && i + 1 < argc) {
+			orientation = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--decimation") == 0 && i + 1 < argc) {
+			decimation = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--loop") == 0 && i + 1 < argc) {
+			passes = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+			outputPath = argv[++i];
+		} else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+			tracePath = argv[++i];
+		} else if (strcmp(argv[i], "--emit-latency") == 0 && i + 1 < argc) {
+			emitInterval = atoi(argv[++i]);
+		} else if (argv[i][0] != '-' && !path) {
+			path = argv[i];
+		} else {
+			android_camera2_replay_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (!path || passes < 1 || emitInterval < 0 || (decimation != 1 && decimation != 2 && decimation != 4) || orientation % 90 != 0 || orientation < 0 || orientation >= 360) {
+		android_camera2_replay_usage(argv[0]);
+		return 1;
+	}
+	return android_camera2_replay_dump(path, orientation, gray8, decimation, passes, outputPath, tracePath, emitInterval);
+}
@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) 2010-2019 Belledonne Communications SARL.
+ *
+ * android-camera2-trace.cpp - Timeline tracing of the Camera2 capture pipeline.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "android-camera2-trace.h"
+
+#include <mediastreamer2/mscommon.h>
+
+#ifdef __ANDROID__
+#include <android/trace.h>
+#endif
+
+#include <stdio.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+
+#define ANDROID_CAMERA2_TRACE_RING_SIZE 4096
+// Sections nested deeper on a thread aren't traced
+#define ANDROID_CAMERA2_TRACE_MAX_DEPTH 16
+
+static const char *android_camera2_trace_event_names[AndroidCamera2TraceEventCount] = {
+	"camera open",
+	"session create",
+	"image callback",
+	"acquire",
+	"convert",
+	"handoff",
+	"process emit",
+	"stop"
+};
+
+struct AndroidCamera2TraceRecord {
+	uint64_t time; // ns, CLOCK_MONOTONIC
+	int tid; // a ring released by an exiting thread keeps its records when reused
+	uint8_t event;
+	bool begin;
+};
+
+/*
+ * Only written by its owner thread. The dump reads it without synchronizing with the writer beyond the write index,
+ * so records being overwritten during a dump may be garbled, which is acceptable for a debugging facility.
+ */
+struct AndroidCamera2TraceRing {
+	AndroidCamera2TraceRing() : next(nullptr), tid(0), owned(false), writeIndex(0) {
+	};
+
+	AndroidCamera2TraceRing *next;
+	int tid;
+	std::atomic<bool> owned;
+	std::atomic<uint32_t> writeIndex;
+	AndroidCamera2TraceRecord records[ANDROID_CAMERA2_TRACE_RING_SIZE];
+};
+
+static std::atomic<int> android_camera2_trace_flags(0);
+// Rings are never freed, a ring released by an exiting thread is reused by the next one
+static std::atomic<AndroidCamera2TraceRing *> android_camera2_trace_rings(nullptr);
+
+/*
+ * Flags are read once per section, when it begins, and kept on a per thread stack so that its end goes to the same
+ * destinations even if they changed meanwhile: ATrace sections and recorded begin/end pairs stay balanced.
+ */
+struct AndroidCamera2TraceThreadState {
+	AndroidCamera2TraceThreadState() : ring(nullptr), depth(0) {
+	};
+
+	~AndroidCamera2TraceThreadState() {
+		if (ring) ring->owned.store(false, std::memory_order_release);
+	};
+
+	AndroidCamera2TraceRing *ring;
+	int depth; // sections begun and not ended yet
+	uint8_t sectionFlags[ANDROID_CAMERA2_TRACE_MAX_DEPTH];
+};
+
+static thread_local AndroidCamera2TraceThreadState android_camera2_trace_thread_state;
+
+static AndroidCamera2TraceRing *android_camera2_trace_get_thread_ring(void) {
+	AndroidCamera2TraceRing *ring = android_camera2_trace_thread_state.ring;
+	if (ring) return ring;
+
+	for (ring = android_camera2_trace_rings.load(std::memory_order_acquire); ring != nullptr; ring = ring->next) {
+		bool owned = false;
+		if (ring->owned.compare_exchange_strong(owned, true)) break;
+	}
+	if (!ring) {
+		ring = new AndroidCamera2TraceRing();
+		ring->owned = true;
+		ring->next = android_camera2_trace_rings.load(std::memory_order_relaxed);
+		while (!android_camera2_trace_rings.compare_exchange_weak(ring->next, ring));
+	}
+
+	ring->tid = (int)syscall(__NR_gettid);
+	android_camera2_trace_thread_state.ring = ring;
+	return ring;
+}
+
+static void android_camera2_trace_record(AndroidCamera2TraceEvent event, bool begin) {
+	AndroidCamera2TraceRing *ring = android_camera2_trace_get_thread_ring();
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	uint32_t index = ring->writeIndex.load(std::memory_order_relaxed);
+	AndroidCamera2TraceRecord *record = &ring->records[index % ANDROID_CAMERA2_TRACE_RING_SIZE];
+	record->time = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	record->tid = ring->tid;
+	record->event = (uint8_t)event;
+	record->begin = begin;
+	ring->writeIndex.store(index + 1, std::memory_order_release);
+}
+
+void android_camera2_trace_set_flags(int flags) {
+#ifndef __ANDROID__
+	flags &= ~ANDROID_CAMERA2_TRACE_ATRACE;
+#endif
+	android_camera2_trace_flags.store(flags, std::memory_order_relaxed);
+	ms_message("[Camera2 Capture] Tracing flags set to %x", flags);
+}
+
+int android_camera2_trace_get_flags(void) {
+	return android_camera2_trace_flags.load(std::memory_order_relaxed);
+}
+
+void android_camera2_trace_begin(AndroidCamera2TraceEvent event) {
+	AndroidCamera2TraceThreadState *state = &android_camera2_trace_thread_state;
+	int flags = state->depth < ANDROID_CAMERA2_TRACE_MAX_DEPTH ? android_camera2_trace_flags.load(std::memory_order_relaxed) : 0;
+	if (state->depth < ANDROID_CAMERA2_TRACE_MAX_DEPTH) state->sectionFlags[state->depth] = (uint8_t)flags;
+	state->depth++;
+	if (flags == 0) return;
+
+	if (flags & ANDROID_CAMERA2_TRACE_RECORD) android_camera2_trace_record(event, true);
+#ifdef __ANDROID__
+	if (flags & ANDROID_CAMERA2_TRACE_ATRACE) ATrace_beginSection(android_camera2_trace_event_names[event]);
+#endif
+}
+
+void android_camera2_trace_end(AndroidCamera2TraceEvent event) {
+	AndroidCamera2TraceThreadState *state = &android_camera2_trace_thread_state;
+	if (state->depth == 0) {
+		ms_error("[Camera2 Capture] Trace section %s ended but never begun", android_camera2_trace_event_names[event]);
+		return;
+	}
+	state->depth--;
+	int flags = state->depth < ANDROID_CAMERA2_TRACE_MAX_DEPTH ? state->sectionFlags[state->depth] : 0;
+	if (flags == 0) return;
+
+	if (flags & ANDROID_CAMERA2_TRACE_RECORD) android_camera2_trace_record(event, false);
+#ifdef __ANDROID__
+	if (flags & ANDROID_CAMERA2_TRACE_ATRACE) ATrace_endSection();
+#endif
+}
+
+int android_camera2_trace_dump(const char *path) {
+	FILE *file = fopen(path, "w");
+	if (!file) {
+		ms_error("[Camera2 Capture] Couldn't open trace file %s", path);
+		return -1;
+	}
+
+	int pid = (int)getpid();
+	int count = 0;
+	fprintf(file, "{\"traceEvents\":[");
+	for (AndroidCamera2TraceRing *ring = android_camera2_trace_rings.load(std::memory_order_acquire); ring != nullptr; ring = ring->next) {
+		uint32_t end = ring->writeIndex.load(std::memory_order_acquire);
+		uint32_t start = end > ANDROID_CAMERA2_TRACE_RING_SIZE ? end - ANDROID_CAMERA2_TRACE_RING_SIZE : 0;
+		for (uint32_t i = start; i < end; i++) {
+			const AndroidCamera2TraceRecord *record = &ring->records[i % ANDROID_CAMERA2_TRACE_RING_SIZE];
+			if (record->event >= AndroidCamera2TraceEventCount) continue;
+			fprintf(file, "%s\n{\"name\":\"%s\",\"cat\":\"camera2\",\"ph\":\"%s\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d}", count == 0 ? "" : ",",
+				android_camera2_trace_event_names[record->event], record->begin ? "B" : "E", record->time / 1000.0, pid, record->tid);
+			count++;
+		}
+	}
+	fprintf(file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+	fclose(file);
+
+	ms_message("[Camera2 Capture] %d trace events written to %s", count, path);
+	return 0;
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2010-2019 Belledonne Communications SARL.
+ *
+ * android-camera2-trace.h - Timeline tracing of the Camera2 capture pipeline.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ANDROID_CAMERA2_TRACE_H
+#define ANDROID_CAMERA2_TRACE_H
+
+/*
+ * Begin/end events are recorded in a lock-free ring owned by the calling thread, and can be forwarded to ATrace
+ * on Android. Recorded events are dumped in the Chrome trace JSON format (chrome://tracing, Perfetto UI).
+ * This file doesn't depend on the camera NDK so it can be used on a host as well.
+ */
+
+#define ANDROID_CAMERA2_TRACE_RECORD 0x1 // keep events in memory for android_camera2_trace_dump()
+#define ANDROID_CAMERA2_TRACE_ATRACE 0x2 // forward events to ATrace, Android only
+
+typedef enum _AndroidCamera2TraceEvent {
+	AndroidCamera2TraceCameraOpen,
+	AndroidCamera2TraceSessionCreate,
+	AndroidCamera2TraceImageCallback,
+	AndroidCamera2TraceAcquire,
+	AndroidCamera2TraceConvert,
+	AndroidCamera2TraceHandoff,
+	AndroidCamera2TraceProcessEmit,
+	AndroidCamera2TraceStop,
+	AndroidCamera2TraceEventCount
+} AndroidCamera2TraceEvent;
+
+/* Sections already begun end with the flags they began with */
+void android_camera2_trace_set_flags(int flags);
+int android_camera2_trace_get_flags(void);
+
+void android_camera2_trace_begin(AndroidCamera2TraceEvent event);
+void android_camera2_trace_end(AndroidCamera2TraceEvent event);
+
+/* Writes the events recorded by all threads, returns 0 on success */
+int android_camera2_trace_dump(const char *path);
+
+struct AndroidCamera2TraceScope {
+	AndroidCamera2TraceScope(AndroidCamera2TraceEvent e) : event(e) {
+		android_camera2_trace_begin(event);
+	};
+
+	~AndroidCamera2TraceScope() {
+		android_camera2_trace_end(event);
+	};
+
+	AndroidCamera2TraceEvent event;
+};
+
+#endif /* ANDROID_CAMERA2_TRACE_H */